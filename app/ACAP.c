@@ -17,6 +17,8 @@
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <curl/curl.h>
@@ -34,11 +36,13 @@
 // Global variables
 static cJSON* app = NULL;
 static cJSON* status_container = NULL;
+static ACAP_JSON_Cache app_cache = { .root = &app };
+static ACAP_JSON_Cache status_cache = { .root = &status_container };
+static unsigned http_cache_epoch = 0; // Keeps ETags from an earlier run from matching
 
 cJSON* 		ACAP_STATUS(void);
 int			ACAP_HTTP(void);
 void		ACAP_HTTP_Process(void);
-void		ACAP_HTTP_Cleanup(void);
 cJSON*		ACAP_EVENTS(void);
 int 		ACAP_FILE_Init(void);
 cJSON* 		ACAP_DEVICE(void);
@@ -111,6 +115,7 @@ cJSON* ACAP(const char* package, ACAP_Config_Update callback) {
     }
 
     cJSON_AddItemToObject(app, "settings", settings);
+    ACAP_STATE_Publish("settings", cJSON_Duplicate(settings, 1));
 
     // Initialize subsystems
 	ACAP_VAPIX_Init();
@@ -145,7 +150,31 @@ ACAP_ENDPOINT_app(const ACAP_HTTP_Response response, const ACAP_HTTP_Request req
         ACAP_HTTP_Respond_Error(response, 405, "Method Not Allowed - Use GET");
         return;
     }
-    ACAP_HTTP_Respond_JSON(response, app);
+    ACAP_HTTP_Respond_JSON_Cached(response, request, &app_cache);
+}
+
+// Merge posted settings, save them and publish the new snapshot.  Main loop only
+static void
+settings_apply(void* data) {
+    cJSON* params = (cJSON*)data;
+    cJSON* settings = cJSON_GetObjectItem(app, "settings");
+    cJSON* param = params->child;
+    while (param) {
+        if (cJSON_GetObjectItem(settings, param->string)) {
+            cJSON_ReplaceItemInObject(settings, param->string, 
+                                    cJSON_Duplicate(param, 1));
+        }
+        param = param->next;
+    }
+
+    ACAP_JSON_Cache_Touch(&app_cache);
+    ACAP_STATE_Publish("settings", cJSON_Duplicate(settings, 1));
+    ACAP_FILE_Write("localdata/settings.json", settings);
+
+    // Notify about update
+    if (ACAP_UpdateCallback) {
+        ACAP_UpdateCallback("settings", settings);
+    }
 }
 
 static void
@@ -159,7 +188,9 @@ ACAP_ENDPOINT_settings(const ACAP_HTTP_Response response, const ACAP_HTTP_Reques
 
     // Handle GET request - return current settings
     if (strcmp(method, "GET") == 0) {
-        ACAP_HTTP_Respond_JSON(response, cJSON_GetObjectItem(app, "settings"));
+        ACAP_Snapshot* settings = ACAP_STATE_Get("settings");
+        ACAP_HTTP_Respond_JSON(response, ACAP_Snapshot_JSON(settings));
+        ACAP_Snapshot_Release(settings);
         return;
     }
 
@@ -187,25 +218,9 @@ ACAP_ENDPOINT_settings(const ACAP_HTTP_Response response, const ACAP_HTTP_Reques
 
         LOG_TRACE("%s: %s\n", __func__, request->postData);
 
-        // Update settings
-        cJSON* settings = cJSON_GetObjectItem(app, "settings");
-        cJSON* param = params->child;
-        while (param) {
-            if (cJSON_GetObjectItem(settings, param->string)) {
-                cJSON_ReplaceItemInObject(settings, param->string, 
-                                        cJSON_Duplicate(param, 1));
-            }
-            param = param->next;
-        }
-
-        // Cleanup and save
+        // The app tree belongs to the main loop
+        ACAP_Main_Call(settings_apply, params);
         cJSON_Delete(params);
-        ACAP_FILE_Write("localdata/settings.json", settings);
-
-        // Notify about update
-        if (ACAP_UpdateCallback) {
-            ACAP_UpdateCallback("settings", settings);
-        }
 
         ACAP_HTTP_Respond_Text(response, "Settings updated successfully");
         return;
@@ -228,6 +243,7 @@ ACAP_Set_Config(const char* service, cJSON* serviceSettings ) {
 		return 1;
 	}
 	cJSON_AddItemToObject( app, service, serviceSettings );
+	ACAP_JSON_Cache_Touch(&app_cache);
 	return 1;
 }
 
@@ -245,13 +261,20 @@ ACAP_Get_Config(const char* service) {
  * HTTP Request Processing Implementation
  *------------------------------------------------------------------*/
 
-static pthread_t http_thread;
+static pthread_t http_threads[ACAP_HTTP_MAX_WORKERS];
+static int http_thread_count = 0;
 static int http_thread_running = 0; // Flag to track thread state
 static pthread_mutex_t http_nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t http_accept_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t http_handler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int http_stream_slots = 1;
+static size_t http_body_limit = ACAP_HTTP_BODY_LIMIT;
+static int http_streams_active = 0;
 
 typedef struct {
     char path[ACAP_MAX_PATH_LENGTH];
     ACAP_HTTP_Callback callback;
+    int streaming;
 } HTTPNode;
 
 // Thread function for FastCGI processing
@@ -267,16 +290,16 @@ static int initialized = 0;
 static int fcgi_sock = -1;
 static HTTPNode http_nodes[ACAP_MAX_HTTP_NODES];
 static int http_node_count = 0;
+static GHashTable* http_routes = NULL; // path -> HTTPNode
 
 
-static const char* get_path_without_query(const char* uri) {
-    static char path[ACAP_MAX_PATH_LENGTH];
+static const char* get_path_without_query(const char* uri, char* path, size_t size) {
     const char* query = strchr(uri, '?');
     
     if (query) {
         size_t path_length = query - uri;
-        if (path_length >= ACAP_MAX_PATH_LENGTH) {
-            path_length = ACAP_MAX_PATH_LENGTH - 1;
+        if (path_length >= size) {
+            path_length = size - 1;
         }
         strncpy(path, uri, path_length);
         path[path_length] = '\0';
@@ -285,6 +308,16 @@ static const char* get_path_without_query(const char* uri) {
     return uri;
 }
 
+static void http_unlock_mutex(void* mutex) {
+    pthread_mutex_unlock((pthread_mutex_t*)mutex);
+}
+
+static void http_release_stream(void* arg) {
+    pthread_mutex_lock(&http_nodes_mutex);
+    http_streams_active--;
+    pthread_mutex_unlock(&http_nodes_mutex);
+}
+
 int ACAP_HTTP() {
 	LOG_TRACE("%s:\n",__func__);
     if (!initialized) {
@@ -293,14 +326,42 @@ int ACAP_HTTP() {
             return 0;
         }
         initialized = 1;
+        http_cache_epoch = (unsigned)time(NULL);
 
-        // Start the FastCGI thread
+        // Size the worker pool from settings
+        int workers = ACAP_HTTP_WORKERS;
+        cJSON* settings = cJSON_GetObjectItem(app, "settings");
+        cJSON* httpWorkers = settings ? cJSON_GetObjectItem(settings, "httpWorkers") : NULL;
+        if (httpWorkers && cJSON_IsNumber(httpWorkers))
+            workers = httpWorkers->valueint;
+        if (workers < 1)
+            workers = 1;
+        if (workers > ACAP_HTTP_MAX_WORKERS)
+            workers = ACAP_HTTP_MAX_WORKERS;
+
+        cJSON* bodyLimit = settings ? cJSON_GetObjectItem(settings, "httpBodyLimit") : NULL;
+        if (bodyLimit && cJSON_IsNumber(bodyLimit) && bodyLimit->valuedouble > 0)
+            http_body_limit = (size_t)bodyLimit->valuedouble;
+
+        // Streaming handlers may hold all but one worker so short
+        // requests always find a free thread
+        http_stream_slots = workers > 1 ? workers - 1 : 1;
+
+        // Start the FastCGI workers
         http_thread_running = 1;
-        if (pthread_create(&http_thread, NULL, fastcgi_thread_func, NULL) != 0) {
-            LOG_WARN("Failed to create FastCGI thread\n");
+        for (int i = 0; i < workers; i++) {
+            if (pthread_create(&http_threads[http_thread_count], NULL, fastcgi_thread_func, NULL) != 0) {
+                LOG_WARN("Failed to create FastCGI thread %d\n", i);
+                break;
+            }
+            http_thread_count++;
+        }
+        if (http_thread_count == 0) {
+            http_thread_running = 0;
             initialized = 0; // Roll back initialization
             return 0;
         }
+        LOG_TRACE("%s: %d FastCGI workers\n", __func__, http_thread_count);
     }
     return 1;
 }
@@ -317,11 +378,14 @@ void ACAP_HTTP_Cleanup() {
         fcgi_sock = -1;
     }
 
-    // Stop the FastCGI thread
+    // Stop the FastCGI workers
     if (http_thread_running) {
-        http_thread_running = 0; // Signal the thread to stop
-		pthread_cancel(http_thread); // Request cancellation
-        pthread_join(http_thread, NULL); // Wait for the thread to finish
+        http_thread_running = 0; // Signal the threads to stop
+        for (int i = 0; i < http_thread_count; i++)
+            pthread_cancel(http_threads[i]); // Request cancellation
+        for (int i = 0; i < http_thread_count; i++)
+            pthread_join(http_threads[i], NULL); // Wait for the threads to finish
+        http_thread_count = 0;
     }
     initialized = 0;
 }
@@ -348,7 +412,7 @@ size_t ACAP_HTTP_Get_Content_Length(const ACAP_HTTP_Request request) {
     return contentLength ? (size_t)atoll(contentLength) : 0;
 }
 
-int ACAP_HTTP_Node(const char *nodename, ACAP_HTTP_Callback callback) {
+static int http_add_node(const char *nodename, ACAP_HTTP_Callback callback, int streaming) {
     pthread_mutex_lock(&http_nodes_mutex); // Lock the mutex
 
     // Prevent buffer overflow
@@ -366,28 +430,104 @@ int ACAP_HTTP_Node(const char *nodename, ACAP_HTTP_Callback callback) {
         snprintf(full_path, ACAP_MAX_PATH_LENGTH, "/local/%s/%s", ACAP_Name(), nodename);
     }
 
+    if (!http_routes)
+        http_routes = g_hash_table_new(g_str_hash, g_str_equal);
+
     // Check for duplicate paths
-    for (int i = 0; i < http_node_count; i++) {
-        if (strcmp(http_nodes[i].path, full_path) == 0) {
-            LOG_WARN("Duplicate HTTP node path: %s", full_path);
-            pthread_mutex_unlock(&http_nodes_mutex); // Unlock the mutex
-            return 0;
-        }
+    if (g_hash_table_contains(http_routes, full_path)) {
+        LOG_WARN("Duplicate HTTP node path: %s", full_path);
+        pthread_mutex_unlock(&http_nodes_mutex); // Unlock the mutex
+        return 0;
     }
 
-    // Add new node
-    snprintf(http_nodes[http_node_count].path, ACAP_MAX_PATH_LENGTH, "%s", full_path);
-    http_nodes[http_node_count].callback = callback;
+    // Add new node; the route table keys on the node's own path
+    HTTPNode* node = &http_nodes[http_node_count];
+    snprintf(node->path, ACAP_MAX_PATH_LENGTH, "%s", full_path);
+    node->callback = callback;
+    node->streaming = streaming;
+    g_hash_table_insert(http_routes, node->path, node);
     http_node_count++;
 
     pthread_mutex_unlock(&http_nodes_mutex); // Unlock the mutex
     return 1;
 }
 
+int ACAP_HTTP_Node(const char *nodename, ACAP_HTTP_Callback callback) {
+    return http_add_node(nodename, callback, 0);
+}
+
+int ACAP_HTTP_Node_Stream(const char *nodename, ACAP_HTTP_Callback callback) {
+    return http_add_node(nodename, callback, 1);
+}
+
+static char* http_url_decode(const char* src, const char* end, char* out) {
+    while (src < end) {
+        if (*src == '+') {
+            *out++ = ' ';
+            src++;
+        } else if (*src == '%' && end - src > 2 &&
+                   isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2])) {
+            char hex[3] = { src[1], src[2], 0 };
+            *out++ = (char)strtol(hex, NULL, 16);
+            src += 3;
+        } else {
+            *out++ = *src++;
+        }
+    }
+    *out++ = '\0';
+    return out;
+}
+
+// Decodes name=value pairs into out; needs at most len + 1 bytes
+static char* http_parse_pairs(ACAP_HTTP_Request_DATA* data, const char* src, size_t len, char* out) {
+    const char* end = src + len;
+    while (src < end && data->paramCount < ACAP_MAX_HTTP_PARAMS) {
+        const char* amp = memchr(src, '&', end - src);
+        const char* pairEnd = amp ? amp : end;
+        const char* eq = memchr(src, '=', pairEnd - src);
+        if (eq && eq > src) {
+            ACAP_HTTP_Param* param = &data->params[data->paramCount++];
+            param->name = out;
+            out = http_url_decode(src, eq, out);
+            param->value = out;
+            out = http_url_decode(eq + 1, pairEnd, out);
+        }
+        src = pairEnd + 1;
+    }
+    return out;
+}
+
+static void http_parse_params(ACAP_HTTP_Request_DATA* data) {
+    const char* body = NULL;
+    size_t bodyLength = 0;
+    size_t queryLength = data->queryString ? strlen(data->queryString) : 0;
+
+    if (data->postData && data->contentType &&
+        strstr(data->contentType, "application/x-www-form-urlencoded")) {
+        body = data->postData;
+        bodyLength = data->postDataLength;
+    }
+    if (!queryLength && !bodyLength)
+        return;
+
+    data->paramData = malloc(queryLength + bodyLength + 2);
+    if (!data->paramData)
+        return;
+
+    // Form fields come first so they take precedence over the query string
+    char* out = data->paramData;
+    if (body)
+        out = http_parse_pairs(data, body, bodyLength, out);
+    if (queryLength)
+        http_parse_pairs(data, data->queryString, queryLength, out);
+}
+
 void ACAP_HTTP_Process() {
 	FCGX_Request request;
     ACAP_HTTP_Request_DATA requestData = {0};
+    char pathBuffer[ACAP_MAX_PATH_LENGTH];
     char* socket_path = NULL;
+    int accepted = 0;
 
     if (!initialized)
 		return;
@@ -396,54 +536,54 @@ void ACAP_HTTP_Process() {
     socket_path = getenv("FCGI_SOCKET_NAME");
     if (!socket_path) {
         LOG_WARN("Failed to get FCGI_SOCKET_NAME\n");
+        sleep(1);
         return;
     }
 
+    // Workers share the listening socket; only one may accept at a time
+    pthread_mutex_lock(&http_accept_mutex);
+    pthread_cleanup_push(http_unlock_mutex, &http_accept_mutex);
+
     // Open socket if not already open
     if (fcgi_sock == -1) {
         fcgi_sock = FCGX_OpenSocket(socket_path, 5);
         if (fcgi_sock < 0) {
             LOG_WARN("Failed to open FCGI socket\n");
-            return;
+            fcgi_sock = -1;
+        } else {
+            chmod(socket_path, 0777);
         }
-        chmod(socket_path, 0777);
     }
 
-    // Initialize request
-    if (FCGX_InitRequest(&request, fcgi_sock, 0) != 0) {
-        LOG_WARN("FCGX_InitRequest failed\n");
-        return;
+    // Initialize and accept the request
+    if (fcgi_sock != -1) {
+        if (FCGX_InitRequest(&request, fcgi_sock, 0) != 0) {
+            LOG_WARN("FCGX_InitRequest failed\n");
+        } else if (FCGX_Accept_r(&request) != 0) {
+            FCGX_Free(&request, 1);
+        } else {
+            accepted = 1;
+        }
     }
 
-    // Accept the request
-    if (FCGX_Accept_r(&request) != 0) {
-        FCGX_Free(&request, 1);
+    pthread_cleanup_pop(1);
+
+    if (!accepted) {
+        if (fcgi_sock == -1)
+            sleep(1);
         return;
     }
 
+    // Handlers take module locks that have no cleanup handlers, so a worker
+    // is only cancelled while it accepts or waits in ACAP_Main_Call
+    int cancelState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+
     // Setup request data structure
     requestData.request = &request;
     requestData.method = FCGX_GetParam("REQUEST_METHOD", request.envp);
     requestData.contentType = FCGX_GetParam("CONTENT_TYPE", request.envp);
     
-    // Handle POST data
-    if (requestData.method && strcmp(requestData.method, "POST") == 0) {
-        size_t contentLength = ACAP_HTTP_Get_Content_Length(&requestData);
-        if (contentLength > 0 && contentLength < ACAP_MAX_BUFFER_SIZE) {
-            char* postData = malloc(contentLength + 1);
-				if (postData) {
-					size_t bytesRead = FCGX_GetStr(postData, contentLength, request.in);
-					if (bytesRead < contentLength) {
-						free(postData);
-						goto cleanup;
-					}
-					postData[bytesRead] = '\0';
-					requestData.postData = postData;
-					requestData.postDataLength = bytesRead;
-				}
-        }
-    }
-
     // Process the request
     const char* uriString = FCGX_GetParam("REQUEST_URI", request.envp);
     if (!uriString) {
@@ -453,31 +593,120 @@ void ACAP_HTTP_Process() {
 
     //LOG_TRACE("%s: Processing URI: %s\n", __func__, uriString);
 
-    // Find and execute matching callback
-    const char* pathOnly = get_path_without_query(uriString);
+    // Find matching callback
+    const char* pathOnly = get_path_without_query(uriString, pathBuffer, sizeof(pathBuffer));
     ACAP_HTTP_Callback matching_callback = NULL;
+    int streaming = 0;
 
-    for (int i = 0; i < http_node_count; i++) {
-        if (strcmp(http_nodes[i].path, pathOnly) == 0) {
-            matching_callback = http_nodes[i].callback;
-            break;
+    pthread_mutex_lock(&http_nodes_mutex);
+    HTTPNode* node = http_routes ? g_hash_table_lookup(http_routes, pathOnly) : NULL;
+    if (node) {
+        matching_callback = node->callback;
+        streaming = node->streaming;
+    }
+    pthread_mutex_unlock(&http_nodes_mutex);
+
+    if (!matching_callback) {
+        ACAP_HTTP_Respond_Error(&request, 404, "Not Found");
+        goto cleanup;
+    }
+
+    // Read the body of any method up to the limit.  Streaming handlers
+    // take larger bodies themselves with ACAP_HTTP_Request_Read
+    size_t contentLength = ACAP_HTTP_Get_Content_Length(&requestData);
+    requestData.bodyRemaining = contentLength;
+    if (contentLength > 0 && contentLength <= http_body_limit) {
+        char* postData = malloc(contentLength + 1);
+        if (!postData) {
+            ACAP_HTTP_Respond_Error(&request, 500, "Memory allocation failed");
+            goto cleanup;
         }
+        size_t bytesRead = 0;
+        while (bytesRead < contentLength) {
+            size_t chunk = contentLength - bytesRead;
+            int got = FCGX_GetStr(postData + bytesRead, chunk > 65536 ? 65536 : (int)chunk, request.in);
+            if (got <= 0)
+                break;
+            bytesRead += got;
+        }
+        if (bytesRead < contentLength) {
+            free(postData);
+            goto cleanup;
+        }
+        postData[bytesRead] = '\0';
+        requestData.postData = postData;
+        requestData.postDataLength = bytesRead;
+        requestData.bodyRemaining = 0;
+    } else if (contentLength > 0 && !streaming) {
+        ACAP_HTTP_Respond_Error(&request, 413, "Payload Too Large");
+        goto cleanup;
     }
 
-    if (matching_callback) {
+    // Parse form and query parameters once for the handlers
+    requestData.queryString = FCGX_GetParam("QUERY_STRING", request.envp);
+    http_parse_params(&requestData);
+
+    if (streaming) {
+        // Streaming handlers run concurrently in a limited number of slots
+        pthread_mutex_lock(&http_nodes_mutex);
+        int slot = http_streams_active < http_stream_slots;
+        if (slot)
+            http_streams_active++;
+        pthread_mutex_unlock(&http_nodes_mutex);
+
+        if (!slot) {
+            ACAP_HTTP_Respond_Error(&request, 503, "Too many active transfers");
+            goto cleanup;
+        }
+        pthread_cleanup_push(http_release_stream, NULL);
         matching_callback(&request, &requestData);
+        pthread_cleanup_pop(1);
     } else {
-        ACAP_HTTP_Respond_Error(&request, 404, "Not Found");
+        // Short handlers keep the single-threaded semantics they were written for
+        pthread_mutex_lock(&http_handler_mutex);
+        pthread_cleanup_push(http_unlock_mutex, &http_handler_mutex);
+        matching_callback(&request, &requestData);
+        pthread_cleanup_pop(1);
     }
 
 cleanup:
     if (requestData.postData) {
         free((void*)requestData.postData);
     }
+    free(requestData.paramData);
     FCGX_Finish_r(&request);
+    pthread_setcancelstate(cancelState, NULL);
     return;
 }
 
+long ACAP_HTTP_Request_Read(const ACAP_HTTP_Request request, void* buffer, size_t size) {
+    if (!request || !request->request || !buffer) {
+        return -1;
+    }
+
+    // A body that was read up front is handed out from memory
+    if (request->postData) {
+        size_t left = request->postDataLength - request->bodyOffset;
+        if (size > left)
+            size = left;
+        memcpy(buffer, request->postData + request->bodyOffset, size);
+        request->bodyOffset += size;
+        return (long)size;
+    }
+
+    if (request->bodyRemaining == 0)
+        return 0;
+    if (size > request->bodyRemaining)
+        size = request->bodyRemaining;
+    if (size > 0x7fffffff)
+        size = 0x7fffffff;
+    int got = FCGX_GetStr(buffer, (int)size, request->request->in);
+    if (got <= 0)
+        return -1;  // Client went away before sending the whole body
+    request->bodyRemaining -= got;
+    return got;
+}
+
 /*------------------------------------------------------------------
  * HTTP Request Parameter Handling Implementation
  *------------------------------------------------------------------*/
@@ -488,63 +717,93 @@ const char* ACAP_HTTP_Request_Param(const ACAP_HTTP_Request request, const char*
         return NULL;
     }
 
-    // First check POST data for parameters
-    if (request->method && strcmp(request->method, "POST") == 0 && 
-        request->contentType && strstr(request->contentType, "application/x-www-form-urlencoded")) {
-        
-        if (request->postData) {
-            char search_param[512];
-            snprintf(search_param, sizeof(search_param), "%s=", name);
-            char* found = strstr(request->postData, search_param);
-            if (found) {
-                found += strlen(search_param);
-                char* end = strchr(found, '&');
-                size_t len = end ? (size_t)(end - found) : strlen(found);
-                
-                // Allocate memory for the result
-                char* result = (char*)malloc(len + 1);
-                if (!result) {
-                    return NULL;
-                }
-                
-                strncpy(result, found, len);
-                result[len] = '\0';
-                return result;  // Caller must free this
-            }
-        }
+    // Values are decoded and owned by the request; callers must not free them
+    for (int i = 0; i < request->paramCount; i++) {
+        if (strcmp(request->params[i].name, name) == 0)
+            return request->params[i].value;
     }
 
-    // Then check query string
-    const char* query_string = FCGX_GetParam("QUERY_STRING", request->request->envp);
-    if (query_string) {
-        char search_param[512];
-        snprintf(search_param, sizeof(search_param), "%s=", name);
-        
-        const char* start = query_string;
-        while ((start = strstr(start, search_param)) != NULL) {
-            // Make sure we found the parameter at the start of the string or after an &
-            if (start != query_string && *(start-1) != '&') {
-                start++;
-                continue;
-            }
-            
-            start += strlen(search_param);
-            char* end = strchr(start, '&');
-            size_t len = end ? (size_t)(end - start) : strlen(start);
-            
-            // Allocate memory for the result
-            char* result = (char*)malloc(len + 1);
-            if (!result) {
-                return NULL;
-            }
-            
-            strncpy(result, start, len);
-            result[len] = '\0';
-            return result;  // Caller must free this
+    return NULL;
+}
+
+
+int ACAP_HTTP_Request_Match(const ACAP_HTTP_Request request, const char* etag) {
+    if (!request || !request->request || !etag)
+        return 0;
+
+    const char* match = FCGX_GetParam("HTTP_IF_NONE_MATCH", request->request->envp);
+    if (!match)
+        return 0;
+    if (strcmp(match, "*") == 0)
+        return 1;
+
+    // The header may list several tags, possibly weak (W/"...")
+    size_t length = strlen(etag);
+    const char* found = match;
+    while ((found = strstr(found, etag)) != NULL) {
+        char next = found[length];
+        if (next == '\0' || next == ',' || next == ' ')
+            return 1;
+        found++;
+    }
+    return 0;
+}
+
+int ACAP_HTTP_Request_Range(const ACAP_HTTP_Request request, long long size, const char* etag,
+                            long long* start, long long* end) {
+    *start = 0;
+    *end = size - 1;
+    if (!request || !request->request)
+        return 200;
+
+    const char* range = FCGX_GetParam("HTTP_RANGE", request->request->envp);
+    if (!range)
+        return 200;
+
+    // A stale validator means the client's partial copy is outdated
+    const char* ifRange = FCGX_GetParam("HTTP_IF_RANGE", request->request->envp);
+    if (ifRange && (!etag || strcmp(ifRange, etag) != 0))
+        return 200;
+
+    while (*range == ' ')
+        range++;
+    if (strncmp(range, "bytes=", 6) != 0)
+        return 200;
+    range += 6;
+
+    // Multipart/byteranges responses are not supported
+    if (strchr(range, ','))
+        return 416;
+
+    char* next;
+    long long first = -1, last = -1;
+    if (*range == '-') {
+        // Suffix range: the last N bytes
+        long long suffix = strtoll(range + 1, &next, 10);
+        if (next == range + 1 || suffix <= 0)
+            return 416;
+        first = suffix >= size ? 0 : size - suffix;
+        last = size - 1;
+    } else {
+        first = strtoll(range, &next, 10);
+        if (next == range || *next != '-')
+            return 416;
+        range = next + 1;
+        if (*range && *range != ' ') {
+            last = strtoll(range, &next, 10);
+            if (next == range)
+                return 416;
         }
+        if (last < 0 || last >= size)
+            last = size - 1;
     }
 
-    return NULL;
+    if (size <= 0 || first < 0 || first >= size || last < first)
+        return 416;
+
+    *start = first;
+    *end = last;
+    return 206;
 }
 
 
@@ -585,6 +844,48 @@ int ACAP_HTTP_Header_FILE(ACAP_HTTP_Response response, const char* filename,
         contenttype, filename, filelength);
 }
 
+int ACAP_HTTP_Header_Range(ACAP_HTTP_Response response, int status, const char* filename,
+                           const char* contenttype, const char* etag,
+                           long long start, long long end, long long size) {
+    if (!response || !contenttype) {
+        return 0;
+    }
+
+    if (status == 416) {
+        return ACAP_HTTP_Respond_String(response,
+            "Status: 416 Range Not Satisfiable\r\n"
+            "Accept-Ranges: bytes\r\n"
+            "Content-Range: bytes */%lld\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n",
+            size);
+    }
+
+    ACAP_HTTP_Respond_String(response, status == 206 ? "Status: 206 Partial Content\r\n" : "Status: 200 OK\r\n");
+    ACAP_HTTP_Respond_String(response, "Content-Type: %s\r\n", contenttype);
+    if (filename)
+        ACAP_HTTP_Respond_String(response, "Content-Disposition: attachment; filename=%s\r\n", filename);
+    ACAP_HTTP_Respond_String(response, "Accept-Ranges: bytes\r\n");
+    if (etag)
+        ACAP_HTTP_Respond_String(response, "ETag: %s\r\n", etag);
+    if (status == 206)
+        ACAP_HTTP_Respond_String(response, "Content-Range: bytes %lld-%lld/%lld\r\n", start, end, size);
+    return ACAP_HTTP_Respond_String(response, "Content-Length: %lld\r\n\r\n", end - start + 1);
+}
+
+int ACAP_HTTP_Respond_Not_Modified(ACAP_HTTP_Response response, const char* etag, const char* cachecontrol) {
+    if (!response || !etag) {
+        return 0;
+    }
+
+    return ACAP_HTTP_Respond_String(response,
+        "Status: 304 Not Modified\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: %s\r\n"
+        "\r\n",
+        etag, cachecontrol ? cachecontrol : "no-cache");
+}
+
 int ACAP_HTTP_Respond_String(ACAP_HTTP_Response response, const char *fmt, ...) {
     if (!response || !response->out || !fmt) {
         return 0;
@@ -603,7 +904,7 @@ int ACAP_HTTP_Respond_String(ACAP_HTTP_Response response, const char *fmt, ...)
     return FCGX_PutStr(buffer, written, response->out) == written;
 }
 
-int ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, cJSON* object) {
+int ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, const cJSON* object) {
     if (!response || !object) {
         LOG_WARN("Invalid response handle or JSON object\n");
         return 0;
@@ -623,6 +924,130 @@ int ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, cJSON* object) {
     return result;
 }
 
+int ACAP_HTTP_Flush(ACAP_HTTP_Response response) {
+    if (!response || !response->out) {
+        return 0;
+    }
+
+    return FCGX_FFlush(response->out) == 0;
+}
+
+struct ACAP_JSON_Text {
+    gint refs;
+    gint generation;
+    char* json;
+    size_t length;
+    char etag[32];
+};
+
+// Guards the text pointer of every cache
+static pthread_mutex_t http_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    ACAP_JSON_Cache* cache;
+    struct ACAP_JSON_Text* text;
+} JSONPrint;
+
+static void json_text_release(struct ACAP_JSON_Text* text) {
+    if (text && g_atomic_int_dec_and_test(&text->refs)) {
+        free(text->json);
+        free(text);
+    }
+}
+
+// Runs where the tree may be read: holding the cache lock or on the main loop
+static void json_cache_print(void* data) {
+    JSONPrint* print = (JSONPrint*)data;
+    gint generation = g_atomic_int_get(&print->cache->generation);
+    cJSON* root = print->cache->build ? print->cache->build() : *print->cache->root;
+    char* json = root ? cJSON_PrintUnformatted(root) : NULL;
+    if (print->cache->build)
+        cJSON_Delete(root);
+    if (!json)
+        return;
+    struct ACAP_JSON_Text* text = calloc(1, sizeof(*text));
+    if (!text) {
+        free(json);
+        return;
+    }
+    text->refs = 1;
+    text->generation = generation;
+    text->json = json;
+    text->length = strlen(json);
+    snprintf(text->etag, sizeof(text->etag), "\"%x-%x\"", http_cache_epoch, (unsigned)generation);
+    print->text = text;
+}
+
+void ACAP_JSON_Cache_Touch(ACAP_JSON_Cache* cache) {
+    if (cache)
+        g_atomic_int_inc(&cache->generation);
+}
+
+void ACAP_JSON_Cache_Free(ACAP_JSON_Cache* cache) {
+    if (!cache)
+        return;
+    pthread_mutex_lock(&http_cache_mutex);
+    struct ACAP_JSON_Text* text = cache->text;
+    cache->text = NULL;
+    pthread_mutex_unlock(&http_cache_mutex);
+    json_text_release(text);
+}
+
+int ACAP_HTTP_Respond_JSON_Cached(ACAP_HTTP_Response response, const ACAP_HTTP_Request request,
+                                  ACAP_JSON_Cache* cache) {
+    if (!response || !cache || (!cache->root && !cache->build)) {
+        LOG_WARN("Invalid response handle or cache\n");
+        return 0;
+    }
+
+    gint generation = g_atomic_int_get(&cache->generation);
+    pthread_mutex_lock(&http_cache_mutex);
+    struct ACAP_JSON_Text* text = cache->text;
+    if (text && text->generation == generation)
+        g_atomic_int_inc(&text->refs);
+    else
+        text = NULL;
+    pthread_mutex_unlock(&http_cache_mutex);
+
+    if (!text) {
+        // The generation is read again where the tree is printed; a change
+        // after that leaves the text behind and it is printed again next time
+        JSONPrint print = { cache, NULL };
+        if (cache->lock) {
+            pthread_mutex_lock(cache->lock);
+            json_cache_print(&print);
+            pthread_mutex_unlock(cache->lock);
+        } else {
+            ACAP_Main_Call(json_cache_print, &print);
+        }
+        text = print.text;
+        if (!text) {
+            LOG_WARN("Failed to serialize JSON\n");
+            ACAP_HTTP_Respond_Error(response, 500, "Failed to serialize JSON");
+            return 0;
+        }
+
+        g_atomic_int_inc(&text->refs);
+        pthread_mutex_lock(&http_cache_mutex);
+        struct ACAP_JSON_Text* previous = cache->text;
+        cache->text = text;
+        pthread_mutex_unlock(&http_cache_mutex);
+        json_text_release(previous);
+    }
+
+    int result;
+    if (ACAP_HTTP_Request_Match(request, text->etag))
+        result = ACAP_HTTP_Respond_Not_Modified(response, text->etag, "no-cache");
+    else
+        result = ACAP_HTTP_Respond_String(response,
+                     "Content-Type: application/json; charset=utf-8\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "ETag: %s\r\n\r\n", text->etag) &&
+                 ACAP_HTTP_Respond_Data(response, text->length, text->json);
+    json_text_release(text);
+    return result;
+}
+
 int ACAP_HTTP_Respond_Data(ACAP_HTTP_Response response, size_t count, const void* data) {
     if (!response || !response->out || !data || count == 0) {
         LOG_WARN("Invalid response parameters\n");
@@ -632,6 +1057,71 @@ int ACAP_HTTP_Respond_Data(ACAP_HTTP_Response response, size_t count, const void
     return FCGX_PutStr(data, count, response->out) == (int)count;
 }
 
+int ACAP_HTTP_Respond_File(ACAP_HTTP_Response response, const char* path,
+                           long long offset, long long length, const char* contenttype) {
+    if (!response || !response->out || !path || offset < 0) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || offset > (long long)st.st_size ||
+        (length > 0 && offset + length > (long long)st.st_size)) {
+        if (fd >= 0)
+            close(fd);
+        if (contenttype)
+            ACAP_HTTP_Respond_Error(response, 404, "File not found");
+        return 0;
+    }
+    if (length <= 0)
+        length = st.st_size - offset;
+
+    if (contenttype) {
+        ACAP_HTTP_Respond_String(response,
+            "Status: 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %lld\r\n"
+            "\r\n",
+            contenttype, length);
+    }
+
+    int result = ACAP_HTTP_Respond_FD(response, fd, offset, length);
+    close(fd);
+    return result;
+}
+
+int ACAP_HTTP_Respond_FD(ACAP_HTTP_Response response, int fd, long long offset, long long length) {
+    if (!response || !response->out || fd < 0 || offset < 0) {
+        return 0;
+    }
+
+    // Map the file a slice at a time so large recordings do not exhaust
+    // the address space, and hand each slice to FCGX without a read copy
+    long long pageMask = sysconf(_SC_PAGESIZE) - 1;
+    int result = 1;
+    while (length > 0 && result) {
+        if (!http_thread_running) {		// Shutting down; let the worker finish
+            result = 0;
+            break;
+        }
+        long long base = offset & ~pageMask;
+        size_t lead = offset - base;
+        size_t slice = length < ACAP_HTTP_FILE_SLICE ? (size_t)length : ACAP_HTTP_FILE_SLICE;
+        char* map = mmap(NULL, lead + slice, PROT_READ, MAP_SHARED, fd, base);
+        if (map == MAP_FAILED) {
+            LOG_WARN("%s: mmap failed: %s\n", __func__, strerror(errno));
+            result = 0;
+            break;
+        }
+        madvise(map, lead + slice, MADV_SEQUENTIAL);
+        result = FCGX_PutStr(map + lead, slice, response->out) == (int)slice;
+        munmap(map, lead + slice);
+        offset += slice;
+        length -= slice;
+    }
+    return result;
+}
+
 int ACAP_HTTP_Respond_Error(ACAP_HTTP_Response response, int code, const char* message) {
     if (!response || !message) {
         return 0;
@@ -660,6 +1150,153 @@ int ACAP_HTTP_Respond_Text(ACAP_HTTP_Response response, const char* message) {
            ACAP_HTTP_Respond_String(response, "%s", message);
 }
 
+/*------------------------------------------------------------------
+ * Shared State Implementation
+ *------------------------------------------------------------------*/
+
+struct ACAP_Snapshot {
+    gint refs;
+    cJSON* tree;
+};
+
+static GHashTable* state_table = NULL; // name -> ACAP_Snapshot*
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void ACAP_Snapshot_Release(ACAP_Snapshot* snapshot) {
+    if (snapshot && g_atomic_int_dec_and_test(&snapshot->refs)) {
+        cJSON_Delete(snapshot->tree);
+        free(snapshot);
+    }
+}
+
+static void state_release(gpointer snapshot) {
+    ACAP_Snapshot_Release((ACAP_Snapshot*)snapshot);
+}
+
+void ACAP_STATE_Publish(const char* name, cJSON* tree) {
+    if (!name || !tree) {
+        LOG_WARN("%s: Invalid parameters\n", __func__);
+        cJSON_Delete(tree);
+        return;
+    }
+
+    ACAP_Snapshot* snapshot = malloc(sizeof(ACAP_Snapshot));
+    if (!snapshot) {
+        LOG_WARN("%s: Out of memory for %s\n", __func__, name);
+        cJSON_Delete(tree);
+        return;
+    }
+    snapshot->refs = 1;
+    snapshot->tree = tree;
+
+    // Readers holding the previous snapshot keep it until they release it
+    pthread_mutex_lock(&state_mutex);
+    if (!state_table)
+        state_table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, state_release);
+    g_hash_table_replace(state_table, g_strdup(name), snapshot);
+    pthread_mutex_unlock(&state_mutex);
+}
+
+ACAP_Snapshot* ACAP_STATE_Get(const char* name) {
+    if (!name)
+        return NULL;
+
+    pthread_mutex_lock(&state_mutex);
+    ACAP_Snapshot* snapshot = state_table ? g_hash_table_lookup(state_table, name) : NULL;
+    if (snapshot)
+        g_atomic_int_inc(&snapshot->refs);
+    pthread_mutex_unlock(&state_mutex);
+    return snapshot;
+}
+
+const cJSON* ACAP_Snapshot_JSON(const ACAP_Snapshot* snapshot) {
+    return snapshot ? snapshot->tree : NULL;
+}
+
+typedef struct {
+    ACAP_Main_Func func;
+    void* data;
+    int running;
+    int done;
+    int abandoned;
+    gint refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MainCall;
+
+static void main_call_release(MainCall* call) {
+    if (g_atomic_int_dec_and_test(&call->refs)) {
+        pthread_mutex_destroy(&call->lock);
+        pthread_cond_destroy(&call->cond);
+        free(call);
+    }
+}
+
+static gboolean main_call_dispatch(gpointer user_data) {
+    MainCall* call = (MainCall*)user_data;
+    pthread_mutex_lock(&call->lock);
+    if (!call->abandoned) {
+        call->running = 1;
+        pthread_mutex_unlock(&call->lock);
+        call->func(call->data);
+        pthread_mutex_lock(&call->lock);
+        call->running = 0;
+    }
+    call->done = 1;
+    pthread_cond_broadcast(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+    main_call_release(call);
+    return G_SOURCE_REMOVE;
+}
+
+// A caller cancelled at shutdown: the call must not run on its stale data
+// later, nor may the caller leave while it runs
+static void main_call_abandon(void* arg) {
+    MainCall* call = (MainCall*)arg;
+    call->abandoned = 1;
+    while (call->running)
+        pthread_cond_wait(&call->cond, &call->lock);
+    pthread_mutex_unlock(&call->lock);
+    main_call_release(call);
+}
+
+void ACAP_Main_Call(ACAP_Main_Func func, void* data) {
+    if (!func)
+        return;
+
+    GMainContext* context = g_main_context_default();
+    if (g_main_context_is_owner(context)) {
+        func(data);
+        return;
+    }
+
+    MainCall* call = calloc(1, sizeof(MainCall));
+    if (!call) {
+        LOG_WARN("%s: Out of memory\n", __func__);
+        return;
+    }
+    call->func = func;
+    call->data = data;
+    call->refs = 2;
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->cond, NULL);
+
+    // Runs right away when no loop owns the context (startup, shutdown)
+    g_main_context_invoke(context, main_call_dispatch, call);
+
+    // A worker waiting here is cancelled at shutdown, when the loop is gone
+    int cancelState;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancelState);
+    pthread_mutex_lock(&call->lock);
+    pthread_cleanup_push(main_call_abandon, call);
+    while (!call->done)
+        pthread_cond_wait(&call->cond, &call->lock);
+    pthread_cleanup_pop(0);
+    pthread_mutex_unlock(&call->lock);
+    pthread_setcancelstate(cancelState, NULL);
+    main_call_release(call);
+}
+
 /*------------------------------------------------------------------
  * Status Management Implementation
  *------------------------------------------------------------------*/
@@ -673,10 +1310,13 @@ ACAP_ENDPOINT_status(const ACAP_HTTP_Response response, const ACAP_HTTP_Request
         return;
     }
 
-	if(!status_container)
-		status_container = cJSON_CreateObject();
-    
-    ACAP_HTTP_Respond_JSON(response, status_container);
+    ACAP_HTTP_Respond_JSON_Cached(response, request, &status_cache);
+}
+
+// Status is served on its own and as part of /app
+static void status_changed(void) {
+    ACAP_JSON_Cache_Touch(&status_cache);
+    ACAP_JSON_Cache_Touch(&app_cache);
 }
 
 cJSON* ACAP_STATUS(void) {
@@ -700,6 +1340,7 @@ cJSON* ACAP_STATUS_Group(const char* name) {
             return NULL;
         }
         cJSON_AddItemToObject(status_container, name, group);
+        status_changed();
     }
     return group;
 }
@@ -723,6 +1364,7 @@ void ACAP_STATUS_SetBool(const char* group, const char* name, int state) {
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateBool(state));
     }
+    status_changed();
 }
 
 void ACAP_STATUS_SetNumber(const char* group, const char* name, double value) {
@@ -742,6 +1384,7 @@ void ACAP_STATUS_SetNumber(const char* group, const char* name, double value) {
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateNumber(value));
     }
+    status_changed();
 }
 
 void ACAP_STATUS_SetString(const char* group, const char* name, const char* string) {
@@ -761,6 +1404,7 @@ void ACAP_STATUS_SetString(const char* group, const char* name, const char* stri
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateString(string));
     }
+    status_changed();
 }
 
 void ACAP_STATUS_SetObject(const char* group, const char* name, cJSON* data) {
@@ -780,6 +1424,7 @@ void ACAP_STATUS_SetObject(const char* group, const char* name, cJSON* data) {
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_Duplicate(data, 1));
     }
+    status_changed();
 }
 
 void ACAP_STATUS_SetNull(const char* group, const char* name) {
@@ -799,6 +1444,7 @@ void ACAP_STATUS_SetNull(const char* group, const char* name) {
     } else {
         cJSON_AddItemToObject(groupObj, name, cJSON_CreateNull());
     }
+    status_changed();
 }
 
 /*------------------------------------------------------------------
@@ -1783,6 +2429,7 @@ ACAP_EVENTS_Main_Callback(guint subscription, AXEvent *axEvent, gpointer user_da
 	if( !eventData )
 		return;
 	cJSON_AddItemReferenceToObject(eventData, "source", (cJSON*)user_data);	
+	cJSON_AddNumberToObject(eventData, "subscription", subscription);
 	if( EVENT_USER_CALLBACK )
 		EVENT_USER_CALLBACK( eventData, (void*)user_data );
 	cJSON_Delete(eventData);
@@ -2423,6 +3070,15 @@ void ACAP_Cleanup(void) {
         cJSON_Delete(status_container);
         status_container = NULL;
     }
+    ACAP_JSON_Cache_Free(&status_cache);
+    ACAP_JSON_Cache_Free(&app_cache);
+
+    pthread_mutex_lock(&state_mutex);
+    if (state_table) {
+        g_hash_table_destroy(state_table);
+        state_table = NULL;
+    }
+    pthread_mutex_unlock(&state_mutex);
 
 	LOG_TRACE("%s:",__func__);
     if (app) {
@@ -7,6 +7,7 @@
 #define _ACAP_H_
 
 #include <glib.h>
+#include <pthread.h>
 #include "fcgi_stdio.h"
 #include "cJSON.h"
 
@@ -19,6 +20,13 @@ extern "C" {
 #define ACAP_MAX_PATH_LENGTH 128
 #define ACAP_MAX_PACKAGE_NAME 30
 #define ACAP_MAX_BUFFER_SIZE 4096
+#define ACAP_MAX_HTTP_PARAMS 16
+#ifndef ACAP_HTTP_FILE_SLICE
+#define ACAP_HTTP_FILE_SLICE (4 * 1024 * 1024) // Bytes mapped per write in ACAP_HTTP_Respond_File
+#endif
+#define ACAP_HTTP_WORKERS 4       // Default FastCGI worker threads (setting httpWorkers)
+#define ACAP_HTTP_MAX_WORKERS 16
+#define ACAP_HTTP_BODY_LIMIT (1024 * 1024) // Largest body read up front (setting httpBodyLimit)
 
 
 // Return types
@@ -38,19 +46,45 @@ typedef void (*ACAP_Config_Update)(const char* service, cJSON* event );
 typedef void (*ACAP_EVENTS_Callback)(cJSON* event, void* user_data);
 
 // HTTP Request/Response structures
+typedef struct {
+    const char* name;
+    const char* value;
+} ACAP_HTTP_Param;
+
 typedef struct {
     FCGX_Request* request;
-    const char* postData;    // Will be NULL for GET requests
+    const char* postData;    // Request body of any method, NULL when empty or above the body limit
     size_t postDataLength;
+    size_t bodyOffset;       // Read position in postData for ACAP_HTTP_Request_Read
+    size_t bodyRemaining;    // Body bytes still unread on the FastCGI stream
     const char* method;      // Request method (GET, POST, etc.)
     const char* contentType; // Content-Type header
     const char* queryString; // Raw query string
+    ACAP_HTTP_Param params[ACAP_MAX_HTTP_PARAMS]; // URL-decoded form and query parameters
+    int paramCount;
+    char* paramData;         // Storage for params, freed with the request
 } ACAP_HTTP_Request_DATA;
 
 typedef ACAP_HTTP_Request_DATA* ACAP_HTTP_Request;
 typedef FCGX_Request* ACAP_HTTP_Response;
 typedef void (*ACAP_HTTP_Callback)(ACAP_HTTP_Response response, const ACAP_HTTP_Request request);
 
+// Serialized form of a JSON tree that is read more often than it changes.
+// The owner bumps the generation with ACAP_JSON_Cache_Touch on every change
+// and the text is printed again on the next request.  The tree is printed
+// holding lock, or on the main loop when lock is NULL; the response is then
+// written from a reference counted copy of the text without either.
+// Owners that keep their data in C structures set build instead of root; the
+// tree it returns is printed and deleted under the same rules.
+struct ACAP_JSON_Text;
+typedef struct {
+    cJSON** root;                // Where the owner keeps the tree
+    cJSON* (*build)(void);       // Or how to build it from the owner's data
+    pthread_mutex_t* lock;       // Guards the tree, NULL when the main loop owns it
+    gint generation;             // Bumped on every change to the tree
+    struct ACAP_JSON_Text* text; // Last printed text
+} ACAP_JSON_Cache;
+
 /*-----------------------------------------------------
  * Core Functions
  *-----------------------------------------------------*/
@@ -60,18 +94,29 @@ const char* ACAP_Name(void);
 int 		ACAP_Set_Config(const char* service, cJSON* serviceSettings);
 cJSON* 		ACAP_Get_Config(const char* service);
 void		ACAP_Cleanup(void);
+// Stop the HTTP workers; called before the modules they use are torn down
+void		ACAP_HTTP_Cleanup(void);
 
 /*-----------------------------------------------------
  * HTTP Functions
  *-----------------------------------------------------*/
 int 		ACAP_HTTP_Node(const char* nodename, ACAP_HTTP_Callback callback);
+// Streaming handlers (large downloads) run outside the handler lock in limited slots
+int 		ACAP_HTTP_Node_Stream(const char* nodename, ACAP_HTTP_Callback callback);
 
 // HTTP Request helpers
 const char* ACAP_HTTP_Get_Method(const ACAP_HTTP_Request request);
 const char* ACAP_HTTP_Get_Content_Type(const ACAP_HTTP_Request request);
 size_t 		ACAP_HTTP_Get_Content_Length(const ACAP_HTTP_Request request);
+// Incremental body reader: bytes read, 0 at the end of the body, -1 on error
+long 		ACAP_HTTP_Request_Read(const ACAP_HTTP_Request request, void* buffer, size_t size);
 const char* ACAP_HTTP_Request_Param(const ACAP_HTTP_Request request, const char* param);
 cJSON* 		ACAP_HTTP_Request_JSON(const ACAP_HTTP_Request request, const char* param);
+// True when If-None-Match names etag (or *)
+int 		ACAP_HTTP_Request_Match(const ACAP_HTTP_Request request, const char* etag);
+// Resolves Range/If-Range against a body of size bytes: 200 (full), 206 or 416
+int 		ACAP_HTTP_Request_Range(const ACAP_HTTP_Request request, long long size, const char* etag,
+                            long long* start, long long* end);
 
 // HTTP Response helpers
 int 		ACAP_HTTP_Header_XML(ACAP_HTTP_Response response);
@@ -79,12 +124,30 @@ int 		ACAP_HTTP_Header_JSON(ACAP_HTTP_Response response);
 int 		ACAP_HTTP_Header_TEXT(ACAP_HTTP_Response response);
 int 		ACAP_HTTP_Header_FILE(ACAP_HTTP_Response response, const char* filename, 
                          const char* contenttype, unsigned filelength);
+int 		ACAP_HTTP_Header_Range(ACAP_HTTP_Response response, int status, const char* filename,
+                           const char* contenttype, const char* etag,
+                           long long start, long long end, long long size);
 
 // HTTP Response functions
 int 		ACAP_HTTP_Respond_String(ACAP_HTTP_Response response, const char* fmt, ...);
-int 		ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, cJSON* object);
+int 		ACAP_HTTP_Respond_JSON(ACAP_HTTP_Response response, const cJSON* object);
+// Responds from cache (304 on a matching If-None-Match), printing the tree only after a change
+int 		ACAP_HTTP_Respond_JSON_Cached(ACAP_HTTP_Response response, const ACAP_HTTP_Request request,
+                                  ACAP_JSON_Cache* cache);
+void 		ACAP_JSON_Cache_Touch(ACAP_JSON_Cache* cache);
+void 		ACAP_JSON_Cache_Free(ACAP_JSON_Cache* cache);
 int 		ACAP_HTTP_Respond_Data(ACAP_HTTP_Response response, size_t count, const void* data);
+// Push buffered output to the client, for streamed responses
+int 		ACAP_HTTP_Flush(ACAP_HTTP_Response response);
+// Sends length bytes (0 = to end of file) from offset. With a content type the
+// 200 headers are written too; otherwise the caller has already sent them.
+int 		ACAP_HTTP_Respond_File(ACAP_HTTP_Response response, const char* path,
+                           long long offset, long long length, const char* contenttype);
+// Sends length bytes from offset of a file the caller has open and closes itself.
+// The headers must already be sent.
+int 		ACAP_HTTP_Respond_FD(ACAP_HTTP_Response response, int fd, long long offset, long long length);
 int 		ACAP_HTTP_Respond_Error(ACAP_HTTP_Response response, int code, const char* message);
+int 		ACAP_HTTP_Respond_Not_Modified(ACAP_HTTP_Response response, const char* etag, const char* cachecontrol);
 int 		ACAP_HTTP_Respond_Text(ACAP_HTTP_Response response, const char* message);
 
 /*-----------------------------------------------------
@@ -132,6 +195,25 @@ double 		ACAP_DEVICE_Uptime(void);
 double 		ACAP_DEVICE_CPU_Average(void);
 double 		ACAP_DEVICE_Network_Average(void);
 
+/*-----------------------------------------------------
+ * Shared State
+ *-----------------------------------------------------*/
+// Trees read from other threads are published as immutable, reference counted
+// snapshots.  The owner publishes a new tree after each change; readers keep
+// the one they got until they release it, so they never wait for the owner
+// and never see a tree change or go away underneath them.
+typedef struct ACAP_Snapshot ACAP_Snapshot;
+
+void		ACAP_STATE_Publish(const char* name, cJSON* tree); // Takes ownership of tree
+ACAP_Snapshot*	ACAP_STATE_Get(const char* name);	// NULL when nothing is published
+const cJSON*	ACAP_Snapshot_JSON(const ACAP_Snapshot* snapshot);
+void		ACAP_Snapshot_Release(ACAP_Snapshot* snapshot);
+
+// Runs func on the main loop and waits for it.  For changes that arrive on
+// HTTP threads; never call it holding a lock the main loop may take.
+typedef void (*ACAP_Main_Func)(void* data);
+void		ACAP_Main_Call(ACAP_Main_Func func, void* data);
+
 /*-----------------------------------------------------
  * Status Management
  *-----------------------------------------------------*/
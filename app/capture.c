@@ -0,0 +1,366 @@
+/*
+ * Capture pipeline.  Triggers on the main loop only queue a request; the
+ * snapshot, the disk writes and the metadata updates run on a dedicated
+ * worker thread so a slow SD card or network share never stalls timers or
+ * event dispatch.  Requests are handled in trigger order, which keeps the
+ * frames of each profile in sequence.
+ *
+ * Triggers that arrive within the coalescing window (settings.json
+ * "coalesceWindow", milliseconds) are handled as one batch.  Requests in a
+ * batch that share resolution and overlay get the same JPEG, so profiles
+ * firing on the same timer tick or event cost one encoder call.
+ *
+ * Each group also takes a CAPTURE_THUMB_WIDTH wide snapshot that is stored
+ * as the frame's thumbnail for the Inspect view.
+ *
+ * A profile is compiled into a CapturePlan when it is activated: parsed
+ * dimensions, the thumbnail size and prebuilt VDO settings.  Queuing a
+ * trigger takes a reference to the plan, so the trigger path does no
+ * parsing or allocation, and a profile changed while its capture waits
+ * keeps its old plan until the capture is done.
+ *
+ * The queue grows with the number of plans, so every profile can have two
+ * triggers outstanding.  Profiles with the same interval fire on the same
+ * scheduler tick, and a fixed queue would drop the same ones every time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+#include "ACAP.h"
+#include "cJSON.h"
+#include "recordings.h"
+#include "snapshot.h"
+#include "capture.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define CAPTURE_QUEUE_SIZE		64		// Minimum queue length, see capture_limit
+#define CAPTURE_STATUS_SECONDS	10
+#define CAPTURE_COALESCE_MS		200		// Default coalescing window
+#define CAPTURE_COALESCE_MAX_MS	5000
+#define CAPTURE_THUMB_WIDTH		320
+
+struct CapturePlan {
+	gint				refs;
+	char*				id;
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		fps;
+	int					overlay;
+	SnapshotSettings*	settings;
+	SnapshotSettings*	thumb;		// NULL when frames are small enough to be their own thumbnail
+};
+
+typedef struct {
+	CapturePlan*	plan;		// Reference held while queued, NULL once handled
+	double			timestamp;	// Trigger time, taken when the request is queued
+} CaptureRequest;
+
+static CaptureRequest* capture_queue = NULL;	// Ring of capture_size requests
+static unsigned int capture_size = 0;
+static unsigned int capture_head = 0;
+static unsigned int capture_count = 0;
+static gint capture_plans = 0;		// Plans alive, for the queue limit
+
+static pthread_t capture_thread;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;
+static int capture_running = 0;
+
+// Counters, protected by capture_mutex
+static unsigned int capture_queued = 0;
+static unsigned int capture_captured = 0;
+static unsigned int capture_failed = 0;
+static unsigned int capture_dropped = 0;
+static unsigned int capture_highwater = 0;
+static unsigned int capture_snapshots = 0;	// Encoder calls for frames
+static unsigned int capture_thumbs = 0;		// Encoder calls for thumbnails
+static unsigned int capture_frames = 0;		// Frames appended from those calls
+
+// Coalescing window in milliseconds, read from settings for each batch
+static int
+capture_window(void) {
+	int window = CAPTURE_COALESCE_MS;
+	ACAP_Snapshot* settings = ACAP_STATE_Get("settings");
+	cJSON* item = cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "coalesceWindow");
+	if (item && cJSON_IsNumber(item))
+		window = item->valueint;
+	ACAP_Snapshot_Release(settings);
+	if (window < 0)
+		window = 0;
+	if (window > CAPTURE_COALESCE_MAX_MS)
+		window = CAPTURE_COALESCE_MAX_MS;
+	return window;
+}
+
+// Queue length above which triggers are dropped: two per plan
+static unsigned int
+capture_limit(void) {
+	unsigned int limit = 2 * (unsigned int)g_atomic_int_get(&capture_plans);
+	return limit > CAPTURE_QUEUE_SIZE ? limit : CAPTURE_QUEUE_SIZE;
+}
+
+// Make room for one more request, called with capture_mutex held
+static int
+capture_reserve(void) {
+	if (capture_count < capture_size)
+		return 1;
+	unsigned int size = capture_size ? capture_size * 2 : CAPTURE_QUEUE_SIZE;
+	CaptureRequest* queue = malloc(size * sizeof(CaptureRequest));
+	if (!queue)
+		return 0;
+	for (unsigned int i = 0; i < capture_count; i++)
+		queue[i] = capture_queue[(capture_head + i) % capture_size];
+	free(capture_queue);
+	capture_queue = queue;
+	capture_size = size;
+	capture_head = 0;
+	return 1;
+}
+
+CapturePlan*
+Capture_Plan_New(const char* profileId, unsigned int width, unsigned int height, unsigned int fps, int overlay) {
+	if (!profileId)
+		return NULL;
+	CapturePlan* plan = calloc(1, sizeof(CapturePlan));
+	if (!plan)
+		return NULL;
+	plan->refs = 1;
+	g_atomic_int_inc(&capture_plans);
+	plan->id = strdup(profileId);
+	plan->width = width;
+	plan->height = height;
+	plan->fps = fps;
+	plan->overlay = overlay;
+	plan->settings = Snapshot_Settings_New(width, height, overlay);
+	if (width > CAPTURE_THUMB_WIDTH) {
+		unsigned int thumbHeight = (height * CAPTURE_THUMB_WIDTH / width) & ~1u;
+		plan->thumb = Snapshot_Settings_New(CAPTURE_THUMB_WIDTH, thumbHeight, overlay);
+	}
+	if (!plan->id || !plan->settings) {
+		Capture_Plan_Unref(plan);
+		return NULL;
+	}
+	return plan;
+}
+
+void
+Capture_Plan_Unref(CapturePlan* plan) {
+	if (!plan || !g_atomic_int_dec_and_test(&plan->refs))
+		return;
+	Snapshot_Settings_Free(plan->settings);
+	Snapshot_Settings_Free(plan->thumb);
+	free(plan->id);
+	free(plan);
+	g_atomic_int_add(&capture_plans, -1);
+}
+
+// Take one JPEG for the first unhandled request in the batch and append it
+// to every later request with the same capture parameters
+static void
+capture_batch(CaptureRequest* batch, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		CapturePlan* plan = batch[i].plan;
+		if (!plan)
+			continue;
+		SnapshotBuffer* snapshot = Snapshot_Capture(plan->settings);
+		SnapshotBuffer* thumb = snapshot && plan->thumb ? Snapshot_Capture(plan->thumb) : NULL;
+		unsigned int captured = 0, failed = 0;
+		for (unsigned int j = i; j < count; j++) {
+			CaptureRequest* request = &batch[j];
+			CapturePlan* target = request->plan;
+			if (!target ||
+				target->width != plan->width ||
+				target->height != plan->height ||
+				target->overlay != plan->overlay)
+				continue;
+			int result = snapshot ? Recordings_Append(target->id, target->width, target->height, target->fps,
+											request->timestamp, Snapshot_Data(snapshot), Snapshot_Size(snapshot),
+											thumb ? Snapshot_Data(thumb) : NULL, thumb ? Snapshot_Size(thumb) : 0) : -1;
+			if (result == 0)
+				captured++;
+			else
+				failed++;
+			request->plan = NULL;
+			if (j != i)		// The first reference is kept for the log line below
+				Capture_Plan_Unref(target);
+		}
+		Snapshot_Release(snapshot);
+		Snapshot_Release(thumb);
+		LOG_TRACE("%s: %ux%u overlay=%d frames=%u\n", __func__, plan->width, plan->height, plan->overlay, captured);
+		Capture_Plan_Unref(plan);
+
+		pthread_mutex_lock(&capture_mutex);
+		if (snapshot) {
+			capture_snapshots++;
+			if (thumb)
+				capture_thumbs++;
+			capture_frames += captured;
+		}
+		capture_captured += captured;
+		capture_failed += failed;
+		pthread_mutex_unlock(&capture_mutex);
+	}
+}
+
+static void*
+Capture_Worker(void* arg) {
+	CaptureRequest* batch = NULL;
+	unsigned int batchSize = 0;
+	LOG_TRACE("%s: Started\n", __func__);
+
+	pthread_mutex_lock(&capture_mutex);
+	while (capture_running) {
+		if (capture_count == 0) {
+			pthread_cond_wait(&capture_cond, &capture_mutex);
+			continue;
+		}
+
+		// Let triggers from the same tick catch up before taking the batch
+		int window = capture_window();
+		if (window > 0) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += window / 1000;
+			deadline.tv_nsec += (long)(window % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			while (capture_running && capture_count < capture_limit() &&
+				   pthread_cond_timedwait(&capture_cond, &capture_mutex, &deadline) == 0);
+			if (!capture_running)
+				break;
+		}
+
+		if (capture_count > batchSize) {
+			CaptureRequest* grown = realloc(batch, capture_size * sizeof(CaptureRequest));
+			if (grown) {
+				batch = grown;
+				batchSize = capture_size;
+			}
+		}
+		unsigned int count = 0;
+		while (capture_count && count < batchSize) {
+			batch[count++] = capture_queue[capture_head];
+			capture_head = (capture_head + 1) % capture_size;
+			capture_count--;
+		}
+		pthread_mutex_unlock(&capture_mutex);
+
+		capture_batch(batch, count);
+
+		pthread_mutex_lock(&capture_mutex);
+	}
+	pthread_mutex_unlock(&capture_mutex);
+	free(batch);
+
+	LOG_TRACE("%s: Exit\n", __func__);
+	return NULL;
+}
+
+int
+Capture_Enqueue(CapturePlan* plan) {
+	if (!plan)
+		return 0;
+
+	double timestamp = ACAP_DEVICE_Timestamp();
+
+	pthread_mutex_lock(&capture_mutex);
+	if (!capture_running || capture_count >= capture_limit() || !capture_reserve()) {
+		capture_dropped++;
+		pthread_mutex_unlock(&capture_mutex);
+		LOG_WARN("%s: Capture queue full, trigger dropped\n", __func__);
+		return 0;
+	}
+	unsigned int tail = (capture_head + capture_count) % capture_size;
+	g_atomic_int_inc(&plan->refs);
+	capture_queue[tail].plan = plan;
+	capture_queue[tail].timestamp = timestamp;
+	capture_count++;
+	capture_queued++;
+	if (capture_count > capture_highwater)
+		capture_highwater = capture_count;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&capture_mutex);
+	return 1;
+}
+
+// Publish the pipeline counters in /status from the main loop
+static gboolean
+Capture_Status_Timer(gpointer user_data) {
+	pthread_mutex_lock(&capture_mutex);
+	unsigned int depth = capture_count;
+	unsigned int queued = capture_queued;
+	unsigned int captured = capture_captured;
+	unsigned int failed = capture_failed;
+	unsigned int dropped = capture_dropped;
+	unsigned int highwater = capture_highwater;
+	unsigned int snapshots = capture_snapshots;
+	unsigned int thumbs = capture_thumbs;
+	unsigned int frames = capture_frames;
+	pthread_mutex_unlock(&capture_mutex);
+
+	ACAP_STATUS_SetNumber("capture", "queue", depth);
+	ACAP_STATUS_SetNumber("capture", "highwater", highwater);
+	ACAP_STATUS_SetNumber("capture", "queued", queued);
+	ACAP_STATUS_SetNumber("capture", "captured", captured);
+	ACAP_STATUS_SetNumber("capture", "failed", failed);
+	ACAP_STATUS_SetNumber("capture", "dropped", dropped);
+	ACAP_STATUS_SetNumber("capture", "encoderCalls", snapshots);
+	ACAP_STATUS_SetNumber("capture", "thumbnails", thumbs);
+	ACAP_STATUS_SetNumber("capture", "frames", frames);
+	// Frames per encoder call; above 1 when profiles share snapshots
+	ACAP_STATUS_SetNumber("capture", "coalescing", snapshots ? (double)frames / snapshots : 0);
+	return G_SOURCE_CONTINUE;
+}
+
+int
+Capture_Init(void) {
+	LOG_TRACE("%s:\n", __func__);
+
+	capture_running = 1;
+	if (pthread_create(&capture_thread, NULL, Capture_Worker, NULL) != 0) {
+		LOG_WARN("%s: Failed to create capture thread\n", __func__);
+		capture_running = 0;
+		return 0;
+	}
+
+	Capture_Status_Timer(NULL);
+	GSource* status_timer = g_timeout_source_new_seconds(CAPTURE_STATUS_SECONDS);
+	g_source_set_callback(status_timer, Capture_Status_Timer, NULL, NULL);
+	g_source_attach(status_timer, NULL);
+	return 1;
+}
+
+void
+Capture_Cleanup(void) {
+	pthread_mutex_lock(&capture_mutex);
+	if (!capture_running) {
+		pthread_mutex_unlock(&capture_mutex);
+		return;
+	}
+	capture_running = 0;
+	pthread_cond_signal(&capture_cond);
+	pthread_mutex_unlock(&capture_mutex);
+
+	pthread_join(capture_thread, NULL);
+
+	// Requests still queued at shutdown are discarded
+	while (capture_count) {
+		Capture_Plan_Unref(capture_queue[capture_head].plan);
+		capture_head = (capture_head + 1) % capture_size;
+		capture_count--;
+	}
+	free(capture_queue);
+	capture_queue = NULL;
+	capture_size = 0;
+}
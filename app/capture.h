@@ -0,0 +1,23 @@
+#ifndef _capture_h_
+#define _capture_h_
+
+#include "cJSON.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct CapturePlan CapturePlan;
+
+int		Capture_Init(void);
+// Compiled once per profile; the trigger path only takes a reference
+CapturePlan*	Capture_Plan_New(const char* profileId, unsigned int width, unsigned int height, unsigned int fps, int overlay);
+void	Capture_Plan_Unref(CapturePlan* plan);
+int		Capture_Enqueue(CapturePlan* plan);
+void	Capture_Cleanup(void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -15,7 +15,11 @@
 #include "cJSON.h"
 #include "timelapse.h"
 #include "recordings.h"
+#include "capture.h"
+#include "snapshot.h"
+#include "sprite.h"
 #include "sunevents.h"
+#include "scheduler.h"
 
 #define APP_PACKAGE "timelapse2"
 
@@ -24,32 +28,22 @@
 //#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
 #define LOG_TRACE(fmt, args...)    {}
 
-void MAIN_Timelapse_Trigger(cJSON* profile) {
-	char* json = cJSON_PrintUnformatted(profile);
-	if (json) {
-		LOG_TRACE("%s: %s\n", __func__, json);
-		free(json);
-	}
-
-	// Check if profile has conditions
-	const char* conditions = cJSON_GetStringValue(cJSON_GetObjectItem(profile, "conditions"));
-	LOG_TRACE("%s: D2D= %d S2S= %d Conditions= %s\n", 
-              __func__, SunEvents_Between_Dawn_Dusk(), SunEvents_Between_Sunrise_Sunset(), conditions ? conditions : "None");
+void MAIN_Timelapse_Trigger(const TimelapseProfile* profile) {
+	LOG_TRACE("%s: %s D2D= %d S2S= %d Condition= %d\n", 
+              __func__, profile->id, SunEvents_Between_Dawn_Dusk(), SunEvents_Between_Sunrise_Sunset(), profile->condition);
 
-	if (conditions) {
-		if (strcmp(conditions, "dawn_dusk") == 0 && SunEvents_Between_Dawn_Dusk() == 0 ) {
-			LOG_TRACE("%s: Condition 'dawn_dusk' not met\n", __func__);
-			return;
-		}
-		if (strcmp(conditions, "sunrise-sunset") == 0 && SunEvents_Between_Sunrise_Sunset() == 0 ) {
-			LOG_TRACE("%s: Condition 'sunrise_sunset' not met\n", __func__);
-			return;
-		}
+	if (profile->condition == TIMELAPSE_DAWN_DUSK && SunEvents_Between_Dawn_Dusk() == 0 ) {
+		LOG_TRACE("%s: Condition 'dawn_dusk' not met\n", __func__);
+		return;
+	}
+	if (profile->condition == TIMELAPSE_SUNRISE_SUNSET && SunEvents_Between_Sunrise_Sunset() == 0 ) {
+		LOG_TRACE("%s: Condition 'sunrise_sunset' not met\n", __func__);
+		return;
 	}
 
-	// All conditions met or no conditions, capture the recording
+	// All conditions met or no conditions, queue the capture
 	LOG_TRACE("%s: All conditions met, capturing recording\n", __func__);
-	Recordings_Capture(profile);
+	Capture_Enqueue(profile->plan);
 }
 
 
@@ -59,6 +53,11 @@ void Settings_Updated_Callback(const char* service, cJSON* data) {
     free(json);
 }
 
+static void
+Reset_Profiles(void* data) {
+	Timelapse_Reset();
+}
+
 static void
 HTTP_Endpoint_Reset(const ACAP_HTTP_Response response, 
                               const ACAP_HTTP_Request request) {
@@ -107,7 +106,8 @@ HTTP_Endpoint_Reset(const ACAP_HTTP_Response response,
     }
     closedir(dir);
 
-	Timelapse_Reset();
+	// Profiles are reloaded on the main loop, which owns them
+	ACAP_Main_Call(Reset_Profiles, NULL);
 	Recordings_Reset();
 	LOG("Everythin reset\n");
     ACAP_HTTP_Respond_Text(response, "OK");
@@ -145,8 +145,12 @@ int main(void) {
 
     // Initialize ACAP and Timelapse
     ACAP(APP_PACKAGE, Settings_Updated_Callback);
+	Scheduler_Init();
     Timelapse_Init(MAIN_Timelapse_Trigger);
 	Recordings_Init();
+	Snapshot_Init();
+	Capture_Init();
+	Sprite_Init();
     SunEvents_Init();
 
 	//Last resort for a corrupt file system on SD Card
@@ -168,6 +172,12 @@ int main(void) {
 	
     g_main_loop_run(main_loop);
 	LOG("------ Exit %s ------\n",APP_PACKAGE);
+	// No HTTP request may reach a module after its cleanup
+	ACAP_HTTP_Cleanup();
+	Scheduler_Cleanup();
+	Capture_Cleanup();
+	Snapshot_Cleanup();
+	Recordings_Cleanup();
     ACAP_Cleanup();
     closelog();
     return 0;
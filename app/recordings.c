@@ -2,10 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <time.h>
 #include "vdo-stream.h"
 #include "vdo-frame.h"
 #include "vdo-types.h"
@@ -21,7 +28,8 @@
 
 #define PATH_MAX_LEN 1024
 #define RIFF_HEADER_SIZE 44
-#define AVI_ALIGN_SIZE 2048
+#define AVI_ALIGN_SIZE 2048		// Default chunk alignment, settings "alignSize"
+#define AVI_ALIGN_MAX 65536
 
 typedef unsigned int DWORD;
 
@@ -38,6 +46,28 @@ typedef unsigned int DWORD;
 
 #define AVIF_HASINDEX 0x00000010
 
+/*
+ * OpenDML.  New recordings carry a super index ("indx") in the stream list
+ * and continue in "RIFF AVIX" segments once a segment reaches
+ * ODML_SEGMENT_SIZE.  Each closed segment ends with an "ix00" standard index
+ * inside its movi list; the first segment also keeps the legacy idx1 for
+ * players that only read the first RIFF.  Recordings made before OpenDML
+ * support have no super index (hdrl size 208) and stay single-segment.
+ */
+#define ODML_MAX_SEGMENTS		32
+#define ODML_SEGMENT_SIZE		(1024 * 1024 * 1024)
+#define AVI_INDEX_OF_INDEXES	0x00
+#define AVI_INDEX_OF_CHUNKS		0x01
+#define AVI_LEGACY_HDRL_SIZE	208
+
+struct ODML_SUPERINDEX_ENTRY_STRUCT {
+    DWORD offset_low;     // Offset of the ix00 chunk
+    DWORD offset_high;
+    DWORD size;           // Size of the ix00 chunk including its header
+    DWORD duration;       // Frames in the segment
+};
+typedef struct ODML_SUPERINDEX_ENTRY_STRUCT ODML_SUPERINDEX_ENTRY;
+
 struct AVI_HEADER_STRUCT {
     DWORD LIST_RIFF;      // "RIFF"
     DWORD RIFF_size;      // 
@@ -90,6 +120,13 @@ struct AVI_HEADER_STRUCT {
     DWORD strf_ypels_meter;
     DWORD strf_num_colors;
     DWORD strf_imp_colors;
+    DWORD indx;           // "indx"
+    DWORD indx_size;      // 24 + (16 * ODML_MAX_SEGMENTS)
+    DWORD indx_type;      // wLongsPerEntry 4, bIndexSubType 0, bIndexType AVI_INDEX_OF_INDEXES
+    DWORD indx_entries;   // Segments in use
+    DWORD indx_chunk_id;  // "00db"
+    DWORD indx_reserved[3];
+    ODML_SUPERINDEX_ENTRY indx_entry[ODML_MAX_SEGMENTS];
     DWORD LIST_ODML;      // "LIST"
     DWORD LIST_ODML_Size; // 16
     DWORD LIST_ODML_type; // "odml"
@@ -102,6 +139,37 @@ struct AVI_HEADER_STRUCT {
 };
 typedef struct AVI_HEADER_STRUCT AVI_HEADER;
 
+// Bytes the super index adds to the header of a legacy recording
+#define AVI_INDX_CHUNK_SIZE (offsetof(AVI_HEADER, LIST_ODML) - offsetof(AVI_HEADER, indx))
+
+struct ODML_RIFF_AVIX_STRUCT {
+    DWORD LIST_RIFF;      // "RIFF"
+    DWORD RIFF_size;
+    DWORD RIFF_FOURCC;    // "AVIX"
+    DWORD LIST_movi;      // "LIST"
+    DWORD LIST_movi_size;
+    DWORD LIST_movi_name; // "movi"
+};
+typedef struct ODML_RIFF_AVIX_STRUCT ODML_RIFF_AVIX;
+
+struct ODML_STD_INDEX_STRUCT {
+    DWORD fourCC;         // "ix00"
+    DWORD cb;             // Size not including first 8 bytes
+    DWORD type;           // wLongsPerEntry 2, bIndexSubType 0, bIndexType AVI_INDEX_OF_CHUNKS
+    DWORD entries;
+    DWORD chunk_id;       // "00db"
+    DWORD base_low;       // Offset the entries are relative to
+    DWORD base_high;
+    DWORD reserved;
+};
+typedef struct ODML_STD_INDEX_STRUCT ODML_STD_INDEX;
+
+struct ODML_STD_INDEX_ENTRY_STRUCT {
+    DWORD offset;         // Offset of the frame data from the base
+    DWORD size;           // Size of frame, bit 31 clear for key frames
+};
+typedef struct ODML_STD_INDEX_ENTRY_STRUCT ODML_STD_INDEX_ENTRY;
+
 struct AVI_INDEX_ENTRY_STRUCT {
     DWORD fourCC;    // "00dc"
     DWORD flags;     // Usually 0
@@ -122,7 +190,48 @@ struct AVIOLDINDEX_STRUCT {
 };
 typedef struct AVIOLDINDEX_STRUCT AVIOLDINDEX;
 
-static cJSON* Recordings_Container = NULL;
+/*
+ * Metadata of the recording in progress for each profile.  recordings.json
+ * and /recordings are built from this table when they are written.
+ */
+typedef struct {
+    unsigned int images;
+    double size;
+    double first;
+    double last;
+    double archived;
+    unsigned int fps;           // 0 when recorded before fps was kept
+    long long generation;       // 0 when recorded before generations were kept
+} RecordingState;
+
+static GHashTable* Recordings_State = NULL;	// Profile id to RecordingState
+
+static cJSON* recording_json(const RecordingState* recording) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "images", recording->images);
+    cJSON_AddNumberToObject(json, "size", recording->size);
+    cJSON_AddNumberToObject(json, "first", recording->first);
+    cJSON_AddNumberToObject(json, "last", recording->last);
+    cJSON_AddNumberToObject(json, "archived", recording->archived);
+    if (recording->fps)
+        cJSON_AddNumberToObject(json, "fps", recording->fps);
+    if (recording->generation)
+        cJSON_AddNumberToObject(json, "generation", recording->generation);
+    return json;
+}
+
+// The recordings.json document.  Call with recordings_mutex held
+static cJSON* recordings_json(void) {
+    cJSON* container = cJSON_CreateObject();
+    if (!Recordings_State)
+        return container;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, Recordings_State);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        cJSON_AddItemToObject(container, (const char*)key, recording_json((RecordingState*)value));
+    return container;
+}
 
 static DWORD FOURCC(const char* str) {
     DWORD value = 0;
@@ -137,13 +246,118 @@ static DWORD FOURCC(const char* str) {
 }
 
 static cJSON *ArchiveList = NULL;
-static volatile int archiving_in_progress = 0;
 
-static void write_avi_header(FILE* f, DWORD frames, DWORD totalJPEGSize, DWORD width, DWORD height, unsigned int fps);
-static size_t write_avi_frame(FILE* f, const unsigned char* data, size_t size);
-static int avi_add_index_entry(FILE* file, unsigned int frame, unsigned int jpeg_size);
+/*
+ * Archiving rotates the recording.  Under the lock the live AVI gets its
+ * closing index, is moved to a staging name and the profile starts over, so
+ * the next capture already goes to a fresh recording.  Flushing the closed
+ * file, giving it its final name and listing it run on a separate thread.
+ */
+typedef struct {
+	char	staging[PATH_MAX_LEN];	// Closed AVI waiting to be moved
+	char	filename[PATH_MAX_LEN];	// Final name in the archive directory
+	int		copy;					// Staging is on another file system
+	cJSON*	entry;					// Archive list entry, added once the file is in place
+} ArchiveJob;
+
+// Archive threads still running, guarded by recordings_mutex.  Cleanup waits for them
+static unsigned int archive_jobs = 0;
+static pthread_cond_t archive_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Thumbnails are kept in a sidecar next to the AVI they belong to.  The
+ * JPEGs are appended to "<avi>.thumbs" and "<avi>.thumbs.idx" holds one
+ * entry per frame at the frame's position, so a frame rolled back by
+ * recovery simply gets its entry rewritten.  An empty or missing entry
+ * means the frame is served at full size.  The sidecar moves to the
+ * archive with its AVI.
+ */
+#define THUMB_SUFFIX			".thumbs"
+#define THUMB_INDEX_SUFFIX		".thumbs.idx"
+
+typedef struct {
+	uint64_t	offset;		// Position in the .thumbs file
+	DWORD		size;		// JPEG size, 0 when the frame has no thumbnail
+	DWORD		reserved;
+} THUMB_INDEX_ENTRY;
+
+static const char* thumb_suffixes[] = { THUMB_SUFFIX, THUMB_INDEX_SUFFIX };
+
+/*
+ * A writer keeps the AVI and index files of a recording open for as long as
+ * the recording lives.  Frames are appended at a tracked offset and only the
+ * header fields that change with the frame count are patched, and only when
+ * a checkpoint is due.
+ *
+ * The index file is also mapped shared and read-only, so frame lookups for
+ * the image and export endpoints are plain array reads.  Entries are still
+ * written with pwrite, which keeps the file size exact for recovery and is
+ * visible through the mapping at once.  The mapping reserves room past the
+ * end of the file and is grown with mremap.
+ */
+#define WRITER_CHECKPOINT_FRAMES	10
+#define WRITER_CHECKPOINT_SECONDS	60
+#define WRITER_INDEX_RESERVE		(64 * 1024)
+
+typedef struct {
+	int		avi_fd;
+	int		idx_fd;
+	off_t	avi_offset;		// End of the movi data, where the next chunk goes
+	off_t	idx_offset;		// End of the index entries
+	DWORD	frames;
+	DWORD	pending;		// Frames appended since the last checkpoint
+	time_t	checkpoint;		// Time of the last checkpoint
+	char*	index_map;		// Mapping of the index file, NULL until first lookup
+	size_t	index_map_size;
+	int		odml;			// OpenDML layout, 0 for legacy single-segment files
+	DWORD	segment;		// Segment that frames are appended to
+	struct {
+		off_t	riff;		// Offset of the RIFF chunk
+		off_t	movi;		// Offset of the 'movi' fourcc index entries are relative to
+		DWORD	first;		// First frame in the segment
+	} segments[ODML_MAX_SEGMENTS];
+	char	thumb_path[PATH_MAX_LEN];		// Thumbnail sidecar, formatted once per recording
+	char	thumb_index_path[PATH_MAX_LEN];
+	int		thumb_fd;		// Sidecar files, -1 until the first thumbnail
+	int		thumb_index_fd;
+	off_t	thumb_offset;	// End of the thumbnail data, where the next one goes
+	int		view;			// Opened read-only by writer_view and not in Recordings_Writers
+} RecordingWriter;
+
+static GHashTable* Recordings_Writers = NULL;
+
+/*
+ * Recordings are captured on the capture worker while the HTTP thread and the
+ * main loop read and modify the same containers.  The lock is recursive as
+ * archiving clears the recording it archives.
+ */
+static pthread_mutex_t recordings_mutex;
+
+// Serialized /recordings and /archive lists, printed under recordings_mutex
+static ACAP_JSON_Cache recordings_cache = { .build = recordings_json, .lock = &recordings_mutex };
+static ACAP_JSON_Cache archive_cache = { .root = &ArchiveList, .lock = &recordings_mutex };
+
+/*
+ * Per-frame metadata updates are appended to a journal instead of rewriting
+ * recordings.json.  Each line carries the current values of one recording,
+ * "<id> <images> <size> <first> <last>", so replaying the journal over
+ * recordings.json at init restores the latest state.  Structural changes
+ * save the whole container, which also empties the journal.  Once the
+ * journal passes JOURNAL_COMPACT_BYTES it is folded into recordings.json
+ * from the main loop.
+ */
+#define RECORDINGS_FILE			"/var/spool/storage/NetworkShare/timelapse2/recordings.json"
+#define JOURNAL_FILE			"/var/spool/storage/NetworkShare/timelapse2/recordings.journal"
+#define JOURNAL_COMPACT_BYTES	(64 * 1024)
+
+static int journal_fd = -1;
+static off_t journal_size = 0;			// Bytes appended since the last snapshot
+static unsigned int snapshot_generation = 0;	// Bumped by every recordings.json write
+static volatile int journal_compacting = 0;
+
+static void write_avi_header(int fd, DWORD frames, DWORD totalJPEGSize, DWORD width, DWORD height, unsigned int fps);
 static void ensure_profile_directory(const char* profileId);
-static cJSON* load_recordings(void);
+static void load_recordings(void);
 static void save_recordings(void);
 int Recordings_Archive(const char *profileID);
 static void ensure_directory(const char *path);
@@ -152,20 +366,20 @@ static void load_archive_list();
 static void save_archive_list();
 static void update_avi_fps(FILE* f, unsigned int fps);
 int Recordings_Delete_Archive(const char* filename);
-static void write_avi_header(FILE* f, DWORD frames, DWORD totalJPEGSize, DWORD width, DWORD height, unsigned int fps) {
+static void write_avi_header(int fd, DWORD frames, DWORD totalJPEGSize, DWORD width, DWORD height, unsigned int fps) {
     AVI_HEADER header;
     DWORD riffsize;
 
     if (!fps) fps = 30;
 
     header.LIST_RIFF = FOURCC("RIFF");
-    riffsize = sizeof(AVI_HEADER);  // Instead of 220
-    riffsize += sizeof(LIST_INDEX) + totalJPEGSize + (sizeof(LIST_INDEX) * frames); // movi
-    riffsize += sizeof(LIST_INDEX) + (sizeof(AVI_INDEX_ENTRY) * frames); // index
+    riffsize = sizeof(AVI_HEADER) - sizeof(LIST_INDEX);
+    riffsize += totalJPEGSize + (sizeof(LIST_INDEX) * frames); // movi
+    riffsize += sizeof(AVIOLDINDEX) + (sizeof(AVI_INDEX_ENTRY) * frames); // index
     header.RIFF_size = LILEND4(riffsize);
     header.RIFF_FOURCC = FOURCC("AVI ");
     header.LIST_HDRL = FOURCC("LIST");
-    header.hdrl_size = LILEND4(208);
+    header.hdrl_size = LILEND4(AVI_LEGACY_HDRL_SIZE + AVI_INDX_CHUNK_SIZE);
     header.hdrl_name = FOURCC("hdrl");
     header.avih = FOURCC("avih");
     header.avih_size = LILEND4(56);
@@ -186,7 +400,7 @@ static void write_avi_header(FILE* f, DWORD frames, DWORD totalJPEGSize, DWORD w
 
     // Stream LIST
     header.LIST_strl = FOURCC("LIST");
-    header.LIST_strl_size = LILEND4(132);
+    header.LIST_strl_size = LILEND4(132 + AVI_INDX_CHUNK_SIZE);
     header.LIST_strl_name = FOURCC("strl");
     header.STRH_name = FOURCC("strh");
     header.STRH_size = LILEND4(48);
@@ -217,6 +431,15 @@ static void write_avi_header(FILE* f, DWORD frames, DWORD totalJPEGSize, DWORD w
     header.strf_num_colors = LILEND4(0);
     header.strf_imp_colors = LILEND4(0);
 
+    // Super index, filled in as segments are written
+    header.indx = FOURCC("indx");
+    header.indx_size = LILEND4(AVI_INDX_CHUNK_SIZE - sizeof(LIST_INDEX));
+    header.indx_type = LILEND4(4 | (AVI_INDEX_OF_INDEXES << 24));
+    header.indx_entries = LILEND4(0);
+    header.indx_chunk_id = FOURCC("00db");
+    memset(header.indx_reserved, 0, sizeof(header.indx_reserved));
+    memset(header.indx_entry, 0, sizeof(header.indx_entry));
+
     // ODML
     header.LIST_ODML = FOURCC("LIST");
     header.LIST_ODML_Size = LILEND4(16);
@@ -229,77 +452,550 @@ static void write_avi_header(FILE* f, DWORD frames, DWORD totalJPEGSize, DWORD w
 	header.LIST_movi = FOURCC("LIST");
 	header.LIST_movi_size = LILEND4(4 + totalJPEGSize + (frames * sizeof(LIST_INDEX)));
     header.LIST_movi_name = FOURCC("movi");
-	fseek(f, 0, SEEK_SET);
-    fwrite(&header, sizeof(AVI_HEADER), 1, f);
+	pwrite(fd, &header, sizeof(AVI_HEADER), 0);
 }
 
-static int avi_initialize_index(FILE* file) {
+static int avi_initialize_index(int fd) {
     AVIOLDINDEX header;
-    
-    if (!file) return 0;
-    
+
+    if (fd < 0) return 0;
+
     header.fourCC = FOURCC("idx1");
     header.cb = LILEND4(0);  // Initial size is 0
-	fseek(file, 0, SEEK_SET);    
-    return fwrite(&header, sizeof(AVIOLDINDEX), 1, file) == 1;
+    return pwrite(fd, &header, sizeof(AVIOLDINDEX), 0) == sizeof(AVIOLDINDEX);
 }
 
-static int avi_add_index_entry(FILE* file, unsigned int frames, unsigned int jpeg_size) {
-    AVI_INDEX_ENTRY index_entry;
-    AVI_INDEX_ENTRY prev_entry;
-    AVIOLDINDEX header;
-    size_t offset;
-	LOG_TRACE("%s: Frames = %d \n",__func__, frames);
-    if (!file) return 0;
+static int writer_patch(int fd, off_t offset, DWORD value) {
+	DWORD le = LILEND4(value);
+	return pwrite(fd, &le, sizeof(DWORD), offset) == sizeof(DWORD);
+}
 
-    // Update index header with correct size
-    fseek(file, 0, SEEK_SET);
-    header.fourCC = FOURCC("idx1");
-    header.cb = LILEND4(frames * sizeof(AVI_INDEX_ENTRY));
-    fwrite(&header, sizeof(AVIOLDINDEX), 1, file);
-
-    // Calculate offset based on previous frame
-    if (frames > 1) {
-        fseek(file, -sizeof(AVI_INDEX_ENTRY), SEEK_END);
-        fread(&prev_entry, sizeof(AVI_INDEX_ENTRY), 1, file);
-        offset = LILEND4(prev_entry.offset) + LILEND4(prev_entry.size) + sizeof(LIST_INDEX);
-    } else {
-        offset = 4;  // First frame starts after "movi" tag
-    }
+// Offset of a header field that follows the super index, which legacy files lack
+static off_t header_field(RecordingWriter* writer, size_t offset) {
+	return writer->odml ? (off_t)offset : (off_t)(offset - AVI_INDX_CHUNK_SIZE);
+}
 
-    // Create index entry
-    index_entry.fourCC = FOURCC("00db");
-    index_entry.flags = LILEND4(0);
-    index_entry.offset = LILEND4(offset);
-    index_entry.size = LILEND4(jpeg_size);
+// Size of the ix00 chunk that closes a segment with the given frame count
+static size_t ix_size(DWORD frames) {
+	return sizeof(ODML_STD_INDEX) + frames * sizeof(ODML_STD_INDEX_ENTRY);
+}
 
-    fseek(file, 0, SEEK_END);
-    return fwrite(&index_entry, sizeof(AVI_INDEX_ENTRY), 1, file) == 1;
+/*
+ * Size of the index data that follows the current segment when the file is
+ * exported or archived: the idx1 for a legacy file, otherwise the ix00 and,
+ * in the first segment, the idx1.
+ */
+static size_t writer_tail_size(RecordingWriter* writer) {
+	DWORD frames = writer->frames - writer->segments[writer->segment].first;
+	if (!writer->odml)
+		return sizeof(AVIOLDINDEX) + frames * sizeof(AVI_INDEX_ENTRY);
+	size_t size = ix_size(frames);
+	if (writer->segment == 0)
+		size += sizeof(AVIOLDINDEX) + frames * sizeof(AVI_INDEX_ENTRY);
+	return size;
+}
+
+// Patch the frame count and size fields in the AVI and index headers
+static void writer_checkpoint(RecordingWriter* writer) {
+	off_t riff = writer->segments[writer->segment].riff;
+	off_t movi = writer->segments[writer->segment].movi;
+	DWORD segmentFrames = writer->frames - writer->segments[writer->segment].first;
+	size_t ix = writer->odml ? ix_size(segmentFrames) : 0;	// Tail part inside the movi list
+
+	LOG_TRACE("%s: Frames=%u Segment=%u\n", __func__, writer->frames, writer->segment);
+
+	writer_patch(writer->avi_fd, riff + offsetof(AVI_HEADER, RIFF_size), writer->avi_offset + writer_tail_size(writer) - riff - sizeof(LIST_INDEX));
+	if (writer->segment)
+		writer_patch(writer->avi_fd, riff + offsetof(ODML_RIFF_AVIX, LIST_movi_size), writer->avi_offset + ix - movi);
+	else
+		writer_patch(writer->avi_fd, header_field(writer, offsetof(AVI_HEADER, LIST_movi_size)), writer->avi_offset + ix - movi);
+
+	// avih counts the frames of the first RIFF only
+	writer_patch(writer->avi_fd, offsetof(AVI_HEADER, AVIH_TotalFrames), writer->segment ? writer->segments[1].first : writer->frames);
+	writer_patch(writer->avi_fd, offsetof(AVI_HEADER, strh_length), writer->frames);
+	writer_patch(writer->avi_fd, header_field(writer, offsetof(AVI_HEADER, odml_frames)), writer->frames);
+
+	if (writer->odml) {
+		ODML_SUPERINDEX_ENTRY entry;
+		entry.offset_low = LILEND4((DWORD)writer->avi_offset);
+		entry.offset_high = LILEND4((DWORD)((uint64_t)writer->avi_offset >> 32));
+		entry.size = LILEND4(ix);
+		entry.duration = LILEND4(segmentFrames);
+		pwrite(writer->avi_fd, &entry, sizeof(entry),
+			   offsetof(AVI_HEADER, indx_entry) + writer->segment * sizeof(ODML_SUPERINDEX_ENTRY));
+		writer_patch(writer->avi_fd, offsetof(AVI_HEADER, indx_entries), writer->segment + 1);
+	}
+	writer_patch(writer->idx_fd, offsetof(AVIOLDINDEX, cb), writer->frames * sizeof(AVI_INDEX_ENTRY));
+
+	writer->pending = 0;
+	writer->checkpoint = time(NULL);
+}
+
+static void writer_close(gpointer data) {
+	RecordingWriter* writer = (RecordingWriter*)data;
+	if (!writer)
+		return;
+	if (writer->pending)
+		writer_checkpoint(writer);
+	if (writer->index_map)
+		munmap(writer->index_map, writer->index_map_size);
+	close(writer->avi_fd);
+	close(writer->idx_fd);
+	if (writer->thumb_fd >= 0)
+		close(writer->thumb_fd);
+	if (writer->thumb_index_fd >= 0)
+		close(writer->thumb_index_fd);
+	free(writer);
+}
+
+/*
+ * Take the frame count from the index and find the layout and segments of
+ * the AVI.  A frame written to the AVI but never indexed is truncated away
+ * when repair is set, and otherwise only left out.
+ */
+static void writer_scan(RecordingWriter* writer, const char* profileId, int repair) {
+	struct stat st;
+
+	writer->avi_offset = fstat(writer->avi_fd, &st) == 0 ? st.st_size : 0;
+	writer->idx_offset = fstat(writer->idx_fd, &st) == 0 ? st.st_size : 0;
+	if (writer->idx_offset < (off_t)sizeof(AVIOLDINDEX))
+		writer->idx_offset = sizeof(AVIOLDINDEX);
+	writer->frames = (writer->idx_offset - sizeof(AVIOLDINDEX)) / sizeof(AVI_INDEX_ENTRY);
+	writer->idx_offset = sizeof(AVIOLDINDEX) + writer->frames * sizeof(AVI_INDEX_ENTRY);
+
+	// Find the layout and the segments written so far
+	AVI_HEADER header;
+	memset(&header, 0, sizeof(header));
+	pread(writer->avi_fd, &header, sizeof(header), 0);
+	writer->odml = LILEND4(header.hdrl_size) != AVI_LEGACY_HDRL_SIZE;
+	writer->segments[0].riff = 0;
+	writer->segments[0].movi = header_field(writer, offsetof(AVI_HEADER, LIST_movi_name));
+	writer->segments[0].first = 0;
+	writer->segment = 0;
+	if (writer->odml) {
+		DWORD segments = LILEND4(header.indx_entries);
+		while (writer->segment + 1 < segments && writer->segment + 1 < ODML_MAX_SEGMENTS) {
+			DWORD i = writer->segment;
+			DWORD riffSize;
+			if (pread(writer->avi_fd, &riffSize, sizeof(riffSize), writer->segments[i].riff + offsetof(AVI_HEADER, RIFF_size)) != sizeof(riffSize))
+				break;
+			off_t riff = writer->segments[i].riff + sizeof(LIST_INDEX) + LILEND4(riffSize);
+			DWORD first = writer->segments[i].first + LILEND4(header.indx_entry[i].duration);
+			if (riff + (off_t)sizeof(ODML_RIFF_AVIX) > writer->avi_offset || first > writer->frames)
+				break;
+			writer->segment++;
+			writer->segments[i + 1].riff = riff;
+			writer->segments[i + 1].movi = riff + offsetof(ODML_RIFF_AVIX, LIST_movi_name);
+			writer->segments[i + 1].first = first;
+		}
+	}
+	off_t movi = writer->segments[writer->segment].movi;
+	if (writer->avi_offset < movi + (off_t)sizeof(DWORD))
+		writer->avi_offset = movi + sizeof(DWORD);
+
+	// Drop a frame that was written to the AVI but never made it to the index
+	if (writer->frames > writer->segments[writer->segment].first) {
+		AVI_INDEX_ENTRY last;
+		if (pread(writer->idx_fd, &last, sizeof(last), writer->idx_offset - sizeof(last)) == sizeof(last)) {
+			off_t end = movi + LILEND4(last.offset) + sizeof(LIST_INDEX) + LILEND4(last.size);
+			// Keep the JUNK chunk that aligns the last frame
+			LIST_INDEX junk;
+			if (pread(writer->avi_fd, &junk, sizeof(junk), end) == sizeof(junk) && junk.fourCC == FOURCC("JUNK") &&
+			    end + (off_t)sizeof(LIST_INDEX) + LILEND4(junk.size) <= writer->avi_offset)
+				end += sizeof(LIST_INDEX) + LILEND4(junk.size);
+			if (end < writer->avi_offset) {
+				writer->avi_offset = end;
+				if (repair) {
+					LOG_WARN("%s: Truncating incomplete frame in %s\n", __func__, profileId);
+					ftruncate(writer->avi_fd, end);
+				}
+			}
+		}
+	} else {
+		writer->avi_offset = movi + sizeof(DWORD);
+	}
+}
+
+/*
+ * Open the writer for a recording.  Existing files are reopened and the frame
+ * count is taken from the index, so a recording interrupted between two
+ * checkpoints is recovered.  New files are only created when width is set.
+ */
+static RecordingWriter* writer_open(const char* profileId, DWORD width, DWORD height, unsigned int fps) {
+	char filepath[PATH_MAX_LEN];
+
+	if (!Recordings_Writers)		// Shut down
+		return NULL;
+	RecordingWriter* writer = g_hash_table_lookup(Recordings_Writers, profileId);
+	if (writer)
+		return writer;
+
+	writer = calloc(1, sizeof(RecordingWriter));
+	if (!writer)
+		return NULL;
+	writer->thumb_fd = -1;
+	writer->thumb_index_fd = -1;
+
+	if (width)
+		ensure_profile_directory(profileId);
+	snprintf(writer->thumb_path, sizeof(writer->thumb_path),
+			 "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi" THUMB_SUFFIX, profileId);
+	snprintf(writer->thumb_index_path, sizeof(writer->thumb_index_path),
+			 "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi" THUMB_INDEX_SUFFIX, profileId);
+	sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
+	writer->avi_fd = open(filepath, O_RDWR);
+	if (writer->avi_fd < 0 && width) {
+		writer->avi_fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (writer->avi_fd >= 0)
+			write_avi_header(writer->avi_fd, 0, 0, width, height, fps);
+	}
+
+	sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.idx", profileId);
+	writer->idx_fd = open(filepath, O_RDWR);
+	if (writer->idx_fd < 0 && width) {
+		writer->idx_fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (writer->idx_fd >= 0)
+			avi_initialize_index(writer->idx_fd);
+	}
+
+	if (writer->avi_fd < 0 || writer->idx_fd < 0) {
+		LOG_WARN("%s: Unable to open recording %s: %s\n", __func__, profileId, strerror(errno));
+		if (writer->avi_fd >= 0) close(writer->avi_fd);
+		if (writer->idx_fd >= 0) close(writer->idx_fd);
+		free(writer);
+		return NULL;
+	}
+
+	writer_scan(writer, profileId, 1);
+	writer_checkpoint(writer);
+	g_hash_table_insert(Recordings_Writers, g_strdup(profileId), writer);
+	return writer;
+}
+
+/*
+ * The writer of a recording for reading.  A recording that is not being
+ * written is opened read-only and not kept, so readers never create, recover
+ * or checkpoint its files.  Pass the result to writer_view_release.  Call
+ * with recordings_mutex held
+ */
+static RecordingWriter* writer_view(const char* profileId) {
+	char filepath[PATH_MAX_LEN];
+
+	if (!Recordings_Writers)		// Shut down
+		return NULL;
+	RecordingWriter* writer = g_hash_table_lookup(Recordings_Writers, profileId);
+	if (writer)
+		return writer;
+
+	writer = calloc(1, sizeof(RecordingWriter));
+	if (!writer)
+		return NULL;
+	writer->view = 1;
+	writer->thumb_fd = -1;
+	writer->thumb_index_fd = -1;
+	sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
+	writer->avi_fd = open(filepath, O_RDONLY);
+	sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.idx", profileId);
+	writer->idx_fd = open(filepath, O_RDONLY);
+	if (writer->avi_fd < 0 || writer->idx_fd < 0) {
+		if (writer->avi_fd >= 0) close(writer->avi_fd);
+		if (writer->idx_fd >= 0) close(writer->idx_fd);
+		free(writer);
+		return NULL;
+	}
+	writer_scan(writer, profileId, 0);
+	return writer;
+}
+
+static void writer_view_release(RecordingWriter* writer) {
+	if (writer && writer->view)
+		writer_close(writer);
+}
+
+// Make sure the index mapping covers the entries written so far
+static AVI_INDEX_ENTRY* writer_index(RecordingWriter* writer) {
+	if (!writer->index_map || (size_t)writer->idx_offset > writer->index_map_size) {
+		long page = sysconf(_SC_PAGESIZE);
+		size_t size = writer->index_map_size * 2;
+		if (size < (size_t)writer->idx_offset + WRITER_INDEX_RESERVE)
+			size = writer->idx_offset + WRITER_INDEX_RESERVE;
+		size = (size + page - 1) / page * page;
+
+		void* map;
+		if (writer->index_map)
+			map = mremap(writer->index_map, writer->index_map_size, size, MREMAP_MAYMOVE);
+		else
+			map = mmap(NULL, size, PROT_READ, MAP_SHARED, writer->idx_fd, 0);
+		if (map == MAP_FAILED) {
+			LOG_WARN("%s: Unable to map index: %s\n", __func__, strerror(errno));
+			if (writer->index_map)
+				munmap(writer->index_map, writer->index_map_size);
+			writer->index_map = NULL;
+			writer->index_map_size = 0;
+			return NULL;
+		}
+		writer->index_map = map;
+		writer->index_map_size = size;
+	}
+	return (AVI_INDEX_ENTRY*)(writer->index_map + sizeof(AVIOLDINDEX));
+}
+
+// Look up frame N (1-based) of a recording and return the file offset of its
+// chunk.  Call with recordings_mutex held
+static int writer_lookup(RecordingWriter* writer, unsigned int frame, off_t* offset, DWORD* size) {
+	if (!writer || frame < 1 || frame > writer->frames)
+		return 0;
+	AVI_INDEX_ENTRY* index = writer_index(writer);
+	if (!index)
+		return 0;
+	DWORD segment = writer->segment;
+	while (segment > 0 && frame - 1 < writer->segments[segment].first)
+		segment--;
+	*offset = writer->segments[segment].movi + LILEND4(index[frame - 1].offset);
+	*size = LILEND4(index[frame - 1].size);
+	return 1;
+}
+
+// Store the thumbnail of frame N (1-based).  The sidecar files stay open
+// with the writer.  Call with recordings_mutex held
+static void thumb_append(RecordingWriter* writer, DWORD frame, const unsigned char* data, unsigned int size) {
+	THUMB_INDEX_ENTRY entry = {0};
+	struct stat st;
+
+	if (frame < 1)
+		return;
+	if (data && size) {
+		if (writer->thumb_fd < 0) {
+			writer->thumb_fd = open(writer->thumb_path, O_WRONLY | O_CREAT, 0644);
+			writer->thumb_offset = writer->thumb_fd >= 0 && fstat(writer->thumb_fd, &st) == 0 ? st.st_size : 0;
+		}
+		if (writer->thumb_fd >= 0 && pwrite(writer->thumb_fd, data, size, writer->thumb_offset) == (ssize_t)size) {
+			entry.offset = writer->thumb_offset;
+			entry.size = size;
+			writer->thumb_offset += size;
+		}
+	}
+
+	if (writer->thumb_index_fd < 0)
+		writer->thumb_index_fd = open(writer->thumb_index_path, O_WRONLY | O_CREAT, 0644);
+	if (writer->thumb_index_fd < 0)
+		return;
+	if (pwrite(writer->thumb_index_fd, &entry, sizeof(entry), (off_t)(frame - 1) * sizeof(entry)) != sizeof(entry))
+		LOG_WARN("%s: Failed to index thumbnail %u of %s\n", __func__, frame, writer->thumb_index_path);
+}
+
+// Look up the thumbnail of frame N (1-based).  Call with recordings_mutex held
+static int thumb_lookup(const char* profileId, DWORD frame, off_t* offset, DWORD* size) {
+	char path[PATH_MAX_LEN];
+	THUMB_INDEX_ENTRY entry;
+
+	if (frame < 1)
+		return 0;
+	snprintf(path, sizeof(path), "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi" THUMB_INDEX_SUFFIX, profileId);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	int found = pread(fd, &entry, sizeof(entry), (off_t)(frame - 1) * sizeof(entry)) == sizeof(entry) && entry.size;
+	close(fd);
+	if (found) {
+		*offset = entry.offset;
+		*size = entry.size;
+	}
+	return found;
+}
+
+// Build the index data described by writer_tail_size
+static char* writer_tail(RecordingWriter* writer, size_t* size) {
+	AVI_INDEX_ENTRY* entries = writer_index(writer);
+	if (!entries)
+		return NULL;
+	DWORD first = writer->segments[writer->segment].first;
+	DWORD frames = writer->frames - first;
+	off_t movi = writer->segments[writer->segment].movi;
+
+	*size = writer_tail_size(writer);
+	char* tail = malloc(*size);
+	if (!tail)
+		return NULL;
+	char* pos = tail;
+
+	if (writer->odml) {
+		ODML_STD_INDEX ix;
+		ix.fourCC = FOURCC("ix00");
+		ix.cb = LILEND4(ix_size(frames) - sizeof(LIST_INDEX));
+		ix.type = LILEND4(2 | (AVI_INDEX_OF_CHUNKS << 24));
+		ix.entries = LILEND4(frames);
+		ix.chunk_id = FOURCC("00db");
+		ix.base_low = LILEND4((DWORD)movi);
+		ix.base_high = LILEND4((DWORD)((uint64_t)movi >> 32));
+		ix.reserved = 0;
+		memcpy(pos, &ix, sizeof(ix));
+		pos += sizeof(ix);
+		for (DWORD i = 0; i < frames; i++) {
+			ODML_STD_INDEX_ENTRY entry;
+			entry.offset = LILEND4(LILEND4(entries[first + i].offset) + sizeof(LIST_INDEX));
+			entry.size = entries[first + i].size;
+			memcpy(pos, &entry, sizeof(entry));
+			pos += sizeof(entry);
+		}
+	}
+	if (!writer->odml || writer->segment == 0) {
+		AVIOLDINDEX idx;
+		idx.fourCC = FOURCC("idx1");
+		idx.cb = LILEND4(frames * sizeof(AVI_INDEX_ENTRY));
+		memcpy(pos, &idx, sizeof(idx));
+		pos += sizeof(idx);
+		memcpy(pos, entries + first, frames * sizeof(AVI_INDEX_ENTRY));
+	}
+	return tail;
+}
+
+// Close the current segment with its index and start a RIFF AVIX segment
+static int writer_rollover(RecordingWriter* writer) {
+	size_t size;
+	char* tail = writer_tail(writer, &size);
+	if (!tail)
+		return 0;
+	writer_checkpoint(writer);
+	ssize_t written = pwrite(writer->avi_fd, tail, size, writer->avi_offset);
+	free(tail);
+	if (written != (ssize_t)size) {
+		LOG_WARN("%s: Segment index write failed: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	off_t riff = writer->avi_offset + size;
+	ODML_RIFF_AVIX avix;
+	avix.LIST_RIFF = FOURCC("RIFF");
+	avix.RIFF_size = LILEND4(sizeof(ODML_RIFF_AVIX) - sizeof(LIST_INDEX));
+	avix.RIFF_FOURCC = FOURCC("AVIX");
+	avix.LIST_movi = FOURCC("LIST");
+	avix.LIST_movi_size = LILEND4(sizeof(DWORD));
+	avix.LIST_movi_name = FOURCC("movi");
+	if (pwrite(writer->avi_fd, &avix, sizeof(avix), riff) != sizeof(avix)) {
+		LOG_WARN("%s: Segment header write failed: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	writer->segment++;
+	writer->segments[writer->segment].riff = riff;
+	writer->segments[writer->segment].movi = riff + offsetof(ODML_RIFF_AVIX, LIST_movi_name);
+	writer->segments[writer->segment].first = writer->frames;
+	writer->avi_offset = riff + sizeof(ODML_RIFF_AVIX);
+	writer_checkpoint(writer);
+	LOG_TRACE("%s: Segment %u at %lld\n", __func__, writer->segment, (long long)riff);
+	return 1;
 }
 
-static size_t write_avi_frame(FILE* f, const unsigned char* data, size_t size) {
-    // Calculate padding needed for 4-byte alignment
-	fseek(f, 0, SEEK_END);	
+// No room left for another segment
+static int writer_full(RecordingWriter* writer) {
+	return writer->odml && writer->segment + 1 >= ODML_MAX_SEGMENTS &&
+	       writer->avi_offset - writer->segments[writer->segment].riff >= ODML_SEGMENT_SIZE;
+}
+
+// Close the writer, patching the headers if frames were added since the last checkpoint
+static void writer_release(const char* profileId) {
+	if (Recordings_Writers)
+		g_hash_table_remove(Recordings_Writers, profileId);
+}
+
+/*
+ * Append a JPEG as a "00db" chunk and add its index entry.  With an alignment
+ * set, the chunk is followed by a JUNK chunk that pads it to the next
+ * boundary, and chunk, padding and JUNK go out in one write, so the storage
+ * sees whole aligned blocks.  Returns the bytes added to the movi list,
+ * not counting the chunk header.
+ */
+static size_t writer_append(RecordingWriter* writer, const unsigned char* data, size_t size, unsigned int align) {
+    static const char zeros[AVI_ALIGN_MAX] = {0};
     unsigned int padding = (4-(size%4)) % 4;
     size_t total_size = size + padding;
+    size_t junk = 0;
 
 	LOG_TRACE("%s:\n",__func__);
 
-    
     LIST_INDEX lindex;
     lindex.fourCC = FOURCC("00db");
     lindex.size = LILEND4(size);
-    
-    fwrite(&lindex, sizeof(LIST_INDEX), 1, f);
-    fwrite((void*)data, 1, size, f);
-    
-    // Write padding if needed
-    if (padding > 0) {
-        char pad[4] = {0};
-        fwrite(pad, 1, padding, f);
-    }
-    
-    return total_size;
+
+	// Start a new segment before this frame would take the current one past the limit
+	if (writer->odml && writer->segment + 1 < ODML_MAX_SEGMENTS &&
+	    writer->frames > writer->segments[writer->segment].first) {
+		off_t projected = writer->avi_offset - writer->segments[writer->segment].riff +
+		                  sizeof(LIST_INDEX) + total_size + align + sizeof(LIST_INDEX) +
+		                  writer_tail_size(writer) + sizeof(ODML_STD_INDEX_ENTRY) + sizeof(AVI_INDEX_ENTRY);
+		if (projected > ODML_SEGMENT_SIZE && !writer_rollover(writer))
+			return 0;
+	}
+
+	if (align) {
+		off_t end = writer->avi_offset + sizeof(LIST_INDEX) + total_size;
+		junk = (align - end % align) % align;
+		if (junk && junk < sizeof(LIST_INDEX))
+			junk += align;	// Too small to hold a JUNK chunk header
+	}
+
+	LIST_INDEX junk_header;
+	junk_header.fourCC = FOURCC("JUNK");
+	junk_header.size = LILEND4(junk ? junk - sizeof(LIST_INDEX) : 0);
+
+	struct iovec iov[6];
+	int iovcnt = 0;
+	iov[iovcnt].iov_base = &lindex;
+	iov[iovcnt++].iov_len = sizeof(LIST_INDEX);
+	iov[iovcnt].iov_base = (void*)data;
+	iov[iovcnt++].iov_len = size;
+	if (padding) {
+		iov[iovcnt].iov_base = (void*)zeros;
+		iov[iovcnt++].iov_len = padding;
+	}
+	if (junk) {
+		size_t fill = junk - sizeof(LIST_INDEX);
+		iov[iovcnt].iov_base = &junk_header;
+		iov[iovcnt++].iov_len = sizeof(LIST_INDEX);
+		while (fill) {
+			size_t part = fill < sizeof(zeros) ? fill : sizeof(zeros);
+			iov[iovcnt].iov_base = (void*)zeros;
+			iov[iovcnt++].iov_len = part;
+			fill -= part;
+		}
+	}
+
+	ssize_t written = pwritev(writer->avi_fd, iov, iovcnt, writer->avi_offset);
+	if (written != (ssize_t)(sizeof(LIST_INDEX) + total_size + junk)) {
+		LOG_WARN("%s: Frame write failed: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	AVI_INDEX_ENTRY index_entry;
+	index_entry.fourCC = FOURCC("00db");
+	index_entry.flags = LILEND4(0);
+	index_entry.offset = LILEND4(writer->avi_offset - writer->segments[writer->segment].movi);
+	index_entry.size = LILEND4(total_size);
+	if (pwrite(writer->idx_fd, &index_entry, sizeof(AVI_INDEX_ENTRY), writer->idx_offset) != sizeof(AVI_INDEX_ENTRY)) {
+		LOG_WARN("%s: Index write failed: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+
+	writer->avi_offset += written;
+	writer->idx_offset += sizeof(AVI_INDEX_ENTRY);
+	writer->frames++;
+	writer->pending++;
+
+	if (writer->pending >= WRITER_CHECKPOINT_FRAMES ||
+	    time(NULL) - writer->checkpoint >= WRITER_CHECKPOINT_SECONDS)
+		writer_checkpoint(writer);
+
+    return total_size + junk;
+}
+
+// Bring the headers of an open recording up to date before it is read as a file
+static void Recordings_Checkpoint(const char* profileId) {
+	pthread_mutex_lock(&recordings_mutex);
+	RecordingWriter* writer = Recordings_Writers ? g_hash_table_lookup(Recordings_Writers, profileId) : NULL;
+	if (writer && writer->pending)
+		writer_checkpoint(writer);
+	pthread_mutex_unlock(&recordings_mutex);
 }
 
 // Helper function to ensure a directory exists
@@ -321,13 +1017,16 @@ static void ensure_directory(const char *path) {
     }
 }
 
-static cJSON* load_recordings(void) {
-    char path[PATH_MAX_LEN];
-    sprintf(path, "/var/spool/storage/NetworkShare/timelapse2/recordings.json");
-    
-    FILE* file = fopen(path, "r");
+static double json_number(const cJSON* object, const char* name) {
+    cJSON* item = cJSON_GetObjectItem(object, name);
+    return item && cJSON_IsNumber(item) ? item->valuedouble : 0;
+}
+
+// Fill Recordings_State from recordings.json
+static void load_recordings(void) {
+    FILE* file = fopen(RECORDINGS_FILE, "r");
     if (!file) {
-        return cJSON_CreateObject();
+        return;
     }
     
     fseek(file, 0, SEEK_END);
@@ -337,7 +1036,7 @@ static cJSON* load_recordings(void) {
     char* json = malloc(size + 1);
     if (!json) {
         fclose(file);
-        return cJSON_CreateObject();
+        return;
     }
     
     fread(json, 1, size, file);
@@ -346,23 +1045,194 @@ static cJSON* load_recordings(void) {
     
     cJSON* recordings = cJSON_Parse(json);
     free(json);
-    
-    return recordings ? recordings : cJSON_CreateObject();
+
+    cJSON* item;
+    cJSON_ArrayForEach(item, recordings) {
+        if (!item->string || !cJSON_IsObject(item))
+            continue;
+        RecordingState* recording = g_new0(RecordingState, 1);
+        recording->images = (unsigned int)json_number(item, "images");
+        recording->size = json_number(item, "size");
+        recording->first = json_number(item, "first");
+        recording->last = json_number(item, "last");
+        recording->archived = json_number(item, "archived");
+        recording->fps = (unsigned int)json_number(item, "fps");
+        recording->generation = (long long)json_number(item, "generation");
+        g_hash_table_replace(Recordings_State, g_strdup(item->string), recording);
+    }
+    cJSON_Delete(recordings);
+}
+
+static void journal_open(int truncate) {
+    if (journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = open(JOURNAL_FILE, O_RDWR | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0644);
+    if (journal_fd < 0) {
+        LOG_WARN("%s: Unable to open %s: %s\n", __func__, JOURNAL_FILE, strerror(errno));
+        journal_size = 0;
+        return;
+    }
+    journal_size = lseek(journal_fd, 0, SEEK_END);
+}
+
+// Write a serialized container as recordings.json through a temporary file
+static int write_recordings_file(const char* json, const char* tmp) {
+    FILE* file = fopen(tmp, "w");
+    if (!file) {
+        LOG_WARN("%s: Unable to create %s\n", __func__, tmp);
+        return 0;
+    }
+    int ok = fwrite(json, strlen(json), 1, file) == 1;
+    if (fclose(file) != 0)
+        ok = 0;
+    if (!ok || rename(tmp, RECORDINGS_FILE) != 0) {
+        LOG_WARN("%s: Unable to write %s\n", __func__, RECORDINGS_FILE);
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
 }
 
 static void save_recordings(void) {
-    char path[PATH_MAX_LEN];
-    sprintf(path, "/var/spool/storage/NetworkShare/timelapse2/recordings.json");
-    
-    char* json = cJSON_PrintUnformatted(Recordings_Container);
+    cJSON* container = recordings_json();
+    char* json = cJSON_PrintUnformatted(container);
+    cJSON_Delete(container);
     if (!json) return;
     
-    FILE* file = fopen(path, "w");
-    if (file) {
-        fwrite(json, strlen(json), 1, file);
-        fclose(file);
+    ACAP_JSON_Cache_Touch(&recordings_cache);
+    snapshot_generation++;
+    if (write_recordings_file(json, RECORDINGS_FILE ".tmp"))
+        journal_open(1);
+    free(json);
+}
+
+/*
+ * Replay the journal over the container loaded from recordings.json.  A
+ * line is only applied to the recording it was written for: the recording
+ * must exist with the same first timestamp, and frame counts never go back.
+ * This skips lines left from before a clear, an archive or a snapshot that
+ * did not get to empty the journal.
+ */
+static int replay_journal(void) {
+    FILE* file = fopen(JOURNAL_FILE, "r");
+    if (!file)
+        return 0;
+
+    int applied = 0;
+    char line[PATH_MAX_LEN + 128];
+    char id[PATH_MAX_LEN];
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int images;
+        double size, first, last;
+        if (!strchr(line, '\n'))
+            break;	// Torn last line
+        if (sscanf(line, "%255s %u %lf %lf %lf", id, &images, &size, &first, &last) != 5)
+            continue;
+        RecordingState* recording = g_hash_table_lookup(Recordings_State, id);
+        if (!recording || recording->first != first || recording->images > images)
+            continue;
+        recording->images = images;
+        recording->size = size;
+        recording->last = last;
+        applied++;
+    }
+    fclose(file);
+    LOG_TRACE("%s: %d entries applied\n", __func__, applied);
+    return applied;
+}
+
+/*
+ * Fold the journal into recordings.json.  The container is serialized under
+ * the lock but written without it, so captures only wait for the print.
+ * Lines appended meanwhile are carried over to the emptied journal.
+ */
+static gboolean journal_compact(gpointer user_data) {
+    pthread_mutex_lock(&recordings_mutex);
+    cJSON* container = recordings_json();
+    char* json = cJSON_PrintUnformatted(container);
+    cJSON_Delete(container);
+    unsigned int generation = snapshot_generation;
+    off_t covered = journal_size;
+    pthread_mutex_unlock(&recordings_mutex);
+
+    if (!json) {
+        journal_compacting = 0;
+        return G_SOURCE_REMOVE;
     }
+
+    char tmp[PATH_MAX_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.compact", RECORDINGS_FILE);
+    FILE* file = fopen(tmp, "w");
+    int ok = file && fwrite(json, strlen(json), 1, file) == 1;
+    if (file && fclose(file) != 0)
+        ok = 0;
     free(json);
+
+    pthread_mutex_lock(&recordings_mutex);
+    // A full save while the snapshot was written supersedes it
+    if (!ok || generation != snapshot_generation || rename(tmp, RECORDINGS_FILE) != 0) {
+        unlink(tmp);
+    } else if (journal_fd >= 0) {
+        off_t tail = journal_size - covered;
+        char* carry = tail > 0 ? malloc(tail) : NULL;
+        if (carry && pread(journal_fd, carry, tail, covered) != tail) {
+            free(carry);
+            carry = NULL;
+        }
+        snapshot_generation++;
+        journal_open(1);
+        if (carry && journal_fd >= 0 && write(journal_fd, carry, tail) == tail)
+            journal_size = tail;
+        free(carry);
+        LOG_TRACE("%s: Journal compacted, %ld bytes carried over\n", __func__, (long)tail);
+    }
+    journal_compacting = 0;
+    pthread_mutex_unlock(&recordings_mutex);
+    return G_SOURCE_REMOVE;
+}
+
+// Record the current values of one recording
+static void journal_recording(const char* profileId, const RecordingState* recording) {
+    ACAP_JSON_Cache_Touch(&recordings_cache);
+    char line[PATH_MAX_LEN + 128];
+    int len = snprintf(line, sizeof(line), "%s %u %.0f %.0f %.0f\n", profileId,
+                       recording->images, recording->size, recording->first, recording->last);
+    if (journal_fd < 0 || len >= (int)sizeof(line) || write(journal_fd, line, len) != len) {
+        save_recordings();
+        return;
+    }
+    journal_size += len;
+    if (journal_size >= JOURNAL_COMPACT_BYTES && __sync_bool_compare_and_swap(&journal_compacting, 0, 1))
+        g_idle_add(journal_compact, NULL);
+}
+
+// Copy a file, used when a rename would cross file systems
+static int copy_file(const char *source, const char *destination) {
+    FILE *src = fopen(source, "rb");
+    FILE *dest = fopen(destination, "wb");
+    if (!src || !dest) {
+        if (src) fclose(src);
+        if (dest) fclose(dest);
+        return -1;
+    }
+
+    char buffer[65536];
+    size_t bytesRead;
+    int result = 0;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+        if (fwrite(buffer, 1, bytesRead, dest) != bytesRead) {
+            result = -1;
+            break;
+        }
+    }
+    if (ferror(src))
+        result = -1;
+    fclose(src);
+    if (fclose(dest) != 0)
+        result = -1;
+    if (result != 0)
+        unlink(destination);
+    return result;
 }
 
 static int append_file(const char *source, const char *destination) {
@@ -447,6 +1317,7 @@ static void save_archive_list() {
     char path[PATH_MAX_LEN];
     snprintf(path, sizeof(path), "/var/spool/storage/NetworkShare/timelapse2/archive/recordings.json");
 
+    ACAP_JSON_Cache_Touch(&archive_cache);
     char *jsonString = cJSON_PrintUnformatted(ArchiveList);
     if (!jsonString) {
         return;
@@ -464,22 +1335,27 @@ static void save_archive_list() {
 static gboolean check_retention_period(gpointer user_data) {
     // Get retention period from settings
     int retentionMonths = 12;
-    cJSON* settings = ACAP_Get_Config("settings");
-    if (settings && cJSON_GetObjectItem(settings, "retentionMonths")) {
-        retentionMonths = cJSON_GetObjectItem(settings, "retentionMonths")->valueint;
+    ACAP_Snapshot* settings = ACAP_STATE_Get("settings");
+    if (cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "retentionMonths")) {
+        retentionMonths = cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "retentionMonths")->valueint;
     } else {
 		LOG_WARN("%s: Invalid settings retentionMonths configuration\n",__func__);
 	}
+    ACAP_Snapshot_Release(settings);
 
     // Get current time
     time_t now = time(NULL);
     
+    pthread_mutex_lock(&recordings_mutex);
     // Load archive list if not loaded
     if (!ArchiveList) {
         load_archive_list();
     }
     
-    if (!ArchiveList) return G_SOURCE_CONTINUE;
+    if (!ArchiveList) {
+        pthread_mutex_unlock(&recordings_mutex);
+        return G_SOURCE_CONTINUE;
+    }
 
     // Check each archive
     cJSON* archive;
@@ -502,6 +1378,7 @@ static gboolean check_retention_period(gpointer user_data) {
             Recordings_Delete_Archive(filename);
         }
     }
+    pthread_mutex_unlock(&recordings_mutex);
     
     return G_SOURCE_CONTINUE;
 }
@@ -512,6 +1389,9 @@ int Recordings_Clear(const char* profileId) {
         return -1;
     }
 
+    pthread_mutex_lock(&recordings_mutex);
+    writer_release(profileId);
+
     char path[PATH_MAX_LEN];
     sprintf(path, "/var/spool/storage/NetworkShare/timelapse2/%s", profileId);
     
@@ -534,15 +1414,13 @@ int Recordings_Clear(const char* profileId) {
         rmdir(path);
     }
 
-    // Remove from recordings container
-    if (!Recordings_Container) {
-        load_recordings();
-    }
-    cJSON_DeleteItemFromObject(Recordings_Container, profileId);
+    // Remove from recordings metadata
+    g_hash_table_remove(Recordings_State, profileId);
     save_recordings();
 
     // Recreate the directory for new recording
     ensure_profile_directory(profileId);
+    pthread_mutex_unlock(&recordings_mutex);
 
     return 0;
 }
@@ -560,182 +1438,200 @@ static void update_avi_fps(FILE* f, unsigned int fps) {
     fwrite(&rate, sizeof(DWORD), 1, f);
 }
 
-cJSON* Recordings_Get_List(void) {
-    if (!Recordings_Container) {
-        load_recordings();
-    }
-    return Recordings_Container;
+// Generation of a recording, -1 when there is none.  Call with recordings_mutex held
+static long long recording_generation(const char* profileId, unsigned int* frames) {
+    RecordingState* recording = Recordings_State ? g_hash_table_lookup(Recordings_State, profileId) : NULL;
+    if (frames)
+        *frames = recording ? recording->images : 0;
+    if (!recording)
+        return -1;
+    return recording->generation ? recording->generation : (long long)recording->first;
 }
 
-cJSON* Recordings_Get_Metadata(const char* profileId) {
-    if (!Recordings_Container) {
-        load_recordings();
-    }
-    return cJSON_GetObjectItem(Recordings_Container, profileId);
+long long Recordings_Generation(const char* profileId, unsigned int* frames) {
+    pthread_mutex_lock(&recordings_mutex);
+    long long generation = recording_generation(profileId, frames);
+    pthread_mutex_unlock(&recordings_mutex);
+    return generation;
 }
 
-int Recordings_Capture(cJSON* profile) {
-    if (archiving_in_progress) {
-        LOG_WARN("Capture while archiving is in progress\n");
-        return -1;
-    }
-
-    if (!profile) return -1;
-    const char* profileId = cJSON_GetObjectItem(profile, "id")->valuestring;
-    const char* resolution = cJSON_GetObjectItem(profile, "resolution")->valuestring;
-    if (!profileId || !resolution) return -1;
-
-
-	LOG_TRACE("%s: ID=%s Resolution=%s\n",__func__,profileId,resolution);
-
-    // Parse resolution
-    char* width_str = strdup(resolution);
-    char* height_str = strchr(width_str, 'x');
-    if (height_str) {
-        *height_str = '\0';
-        height_str++;
+unsigned char* Recordings_Read_Frame(const char* profileId, unsigned int index, int thumbnail, unsigned int* size) {
+    char path[PATH_MAX_LEN];
+    off_t offset;
+    DWORD length;
+
+    pthread_mutex_lock(&recordings_mutex);
+    RecordingWriter* writer = writer_view(profileId);
+    int found = writer_lookup(writer, index, &offset, &length);
+    writer_view_release(writer);
+    if (found && thumbnail)
+        thumbnail = thumb_lookup(profileId, index, &offset, &length);
+    pthread_mutex_unlock(&recordings_mutex);
+    if (!found || !length)
+        return NULL;
+
+    if (thumbnail) {
+        snprintf(path, sizeof(path), "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi" THUMB_SUFFIX, profileId);
+    } else {
+        snprintf(path, sizeof(path), "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
+        offset += sizeof(LIST_INDEX);
     }
-    int width = width_str ? atoi(width_str) : 1920;
-    int height = height_str ? atoi(height_str) : 1080;
-    free(width_str);
 
-    // Capture image using VDO
-    VdoMap* vdoSettings = vdo_map_new();
-    vdo_map_set_uint32(vdoSettings, "format", VDO_FORMAT_JPEG);
-    vdo_map_set_uint32(vdoSettings, "width", width);
-    vdo_map_set_uint32(vdoSettings, "height", height);
-    if (cJSON_GetObjectItem(profile, "overlay") && 
-        cJSON_GetObjectItem(profile, "overlay")->type == cJSON_True) {
-        vdo_map_set_string(vdoSettings, "overlays", "all,sync");
+    unsigned char* data = malloc(length);
+    int fd = data ? open(path, O_RDONLY) : -1;
+    if (fd < 0 || pread(fd, data, length, offset) != (ssize_t)length) {
+        if (fd >= 0)
+            close(fd);
+        free(data);
+        return NULL;
     }
+    close(fd);
+    *size = length;
+    return data;
+}
 
-    GError* error = NULL;
-    VdoBuffer* buffer = vdo_stream_snapshot(vdoSettings, &error);
-    g_clear_object(&vdoSettings);
-    if (error != NULL) {
-        LOG_WARN("%s: Snapshot capture failed: %s\n", __func__, error->message);
-        g_error_free(error);
-        return -1;
-    }
+int Recordings_Append(const char* profileId, unsigned int width, unsigned int height, unsigned int fps,
+                      double timestamp, const unsigned char* jpegData, unsigned int jpegSize,
+                      const unsigned char* thumbData, unsigned int thumbSize) {
+    if (!profileId || !profileId[0]) return -1;
 
-    // Get image data
-    unsigned char* jpegData = vdo_buffer_get_data(buffer);
-    unsigned int jpegSize = vdo_frame_get_size(buffer);
+	LOG_TRACE("%s: ID=%s Size=%u\n",__func__,profileId,jpegSize);
 
 	if(!jpegData || ! jpegSize ) {
 		LOG_WARN("%s: Invalid capture data\n",__func__);
 		return -1;
 	}
 
-    // Ensure directory exists
-    ensure_profile_directory(profileId);
-
-    double timestamp = ACAP_DEVICE_Timestamp();
-
-    // Load metadata to get current frame count and total size
-    if (!Recordings_Container) {
-        load_recordings();
-    }
-
-    unsigned int frames = 0;
-    unsigned int fps = cJSON_GetObjectItem(profile,"fps")?cJSON_GetObjectItem(profile,"fps")->valueint:10;
-    DWORD totalJPEGSize = 0;
+    pthread_mutex_lock(&recordings_mutex);
 
-    cJSON* recording = cJSON_GetObjectItem(Recordings_Container, profileId);
+    // Current frame count and total size
+    RecordingState* recording = g_hash_table_lookup(Recordings_State, profileId);
+    int created = !recording;
 	
     if (!recording) {
-        recording = cJSON_CreateObject();
-        cJSON_AddItemToObject(Recordings_Container, profileId, recording);
-        cJSON_AddNumberToObject(recording, "images", 0);
-        cJSON_AddNumberToObject(recording, "size", 0);
-        cJSON_AddNumberToObject(recording, "first", timestamp);
-        cJSON_AddNumberToObject(recording, "last", 0);
-        cJSON_AddNumberToObject(recording, "archived", 0);
-        cJSON_AddNumberToObject(recording, "fps", fps);
+        recording = g_new0(RecordingState, 1);
+        recording->first = timestamp;
+        recording->fps = fps;
+        // Identifies this recording's frames in HTTP caches; a cleared or
+        // archived profile starts a new generation
+        recording->generation = (long long)ACAP_DEVICE_Timestamp();
+        g_hash_table_insert(Recordings_State, g_strdup(profileId), recording);
+    }
+    unsigned int frames = recording->images;
+    double totalJPEGSize = recording->size;
+
+    // Chunk alignment, 0 for plain 4 byte padding
+    unsigned int align = AVI_ALIGN_SIZE;
+    double archiveSize = 500;  // Default 500 MB
+    ACAP_Snapshot* settings = ACAP_STATE_Get("settings");
+    cJSON* alignSetting = cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "alignSize");
+    if (alignSetting && cJSON_IsNumber(alignSetting))
+        align = alignSetting->valueint > 0 ? alignSetting->valueint : 0;
+    if (cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "archiveSize")) {
+        archiveSize = cJSON_GetObjectItem(ACAP_Snapshot_JSON(settings), "archiveSize")->valuedouble;
     } else {
-        frames = cJSON_GetObjectItem(recording, "images")->valueint;
-        totalJPEGSize = cJSON_GetObjectItem(recording, "size")->valueint;
+        LOG_WARN("%s: Invalid settings archiveSize configuration\n", __func__);
     }
-
-    // Open or create AVI file
-    char filepath[PATH_MAX_LEN];
-    sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
-    FILE* aviFile = fopen(filepath, "rb+");
-    if (!aviFile) {
-        aviFile = fopen(filepath, "wb+");
-		write_avi_header(aviFile, 1, jpegSize, width, height, fps);
-	}
-
-    // Open or create index file
-    sprintf(filepath, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.idx", profileId);
-    FILE* indexFile = fopen(filepath, "rb+");
-    if (!indexFile) {
-        indexFile = fopen(filepath, "wb+");
-        if (indexFile) {
-            avi_initialize_index(indexFile);
-        }
+    ACAP_Snapshot_Release(settings);
+    if (align > AVI_ALIGN_MAX || (align & (align - 1)) || align % 4) {
+        LOG_WARN("%s: Invalid alignSize %u, using %d\n", __func__, align, AVI_ALIGN_SIZE);
+        align = AVI_ALIGN_SIZE;
     }
 
-    if (!aviFile || !indexFile) {
-        if (aviFile) fclose(aviFile);
-        if (indexFile) fclose(indexFile);
-        g_object_unref(buffer);
+    RecordingWriter* writer = writer_open(profileId, width, height, fps);
+    size_t frameSize = writer ? writer_append(writer, jpegData, jpegSize, align) : 0;
+    if (frameSize)
+        frames = writer->frames;
+
+    if (!frameSize) {
+        pthread_mutex_unlock(&recordings_mutex);
         return -1;
     }
+    totalJPEGSize += frameSize;
+    thumb_append(writer, frames, thumbData, thumbSize);
 
-    size_t frameSize = write_avi_frame(aviFile, jpegData, jpegSize);
-	totalJPEGSize += frameSize;
-	frames++;
-    avi_add_index_entry(indexFile, frames, frameSize);
-	write_avi_header(aviFile, frames, totalJPEGSize, width, height, fps);
+	recording->last = timestamp;
+	recording->images = frames;
+	recording->size = totalJPEGSize;
 
-	cJSON_SetNumberValue(cJSON_GetObjectItem(recording, "last"), timestamp);
-	cJSON_SetNumberValue(cJSON_GetObjectItem(recording, "images"), frames);
-	cJSON_SetNumberValue(cJSON_GetObjectItem(recording, "size"), totalJPEGSize);
-
-    // Cleanup
-    fclose(aviFile);
-    fclose(indexFile);
-    g_object_unref(buffer);
-
-    // Update recordings metadata
-    save_recordings();
+    // Update recordings metadata; a new recording needs a full save
+    if (created) {
+        save_recordings();
+    } else {
+        journal_recording(profileId, recording);
+    }
 
 	// Check if file exceeds size limit
-	int archiveSize = 500;  // Default 500 MB
-	cJSON* settings = ACAP_Get_Config("settings");
-	if (settings && cJSON_GetObjectItem(settings, "archiveSize")) {
-		archiveSize = cJSON_GetObjectItem(settings, "archiveSize")->valueint;
-	} else {
-		LOG_WARN("%s: Invalid settings archiveSize configuration\n", __func__);
-	}
 	archiveSize *= (1024 * 1024);  // Convert MB to bytes
-	LOG_TRACE("%s: Check auto archive %d > %d \n", __func__, totalJPEGSize, archiveSize);
-	if (totalJPEGSize >= archiveSize)
+	LOG_TRACE("%s: Check auto archive %.0f > %.0f \n", __func__, totalJPEGSize, archiveSize);
+	if (totalJPEGSize >= archiveSize || writer_full(writer))
 		Recordings_Archive(profileId);
+    pthread_mutex_unlock(&recordings_mutex);
 
     return 0;
 }
 
+// Second half of an archive: flush the closed file and move it in place
+static void* archive_finish(void* arg) {
+    ArchiveJob* job = (ArchiveJob*)arg;
+    int result = -1;
+
+    if (job->copy) {
+        result = copy_file(job->staging, job->filename);
+        if (result == 0)
+            unlink(job->staging);
+    } else {
+        int fd = open(job->staging, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+        result = rename(job->staging, job->filename);
+    }
+
+    // The thumbnail sidecar follows; the archive is complete without it
+    for (int i = 0; result == 0 && i < 2; i++) {
+        char source[PATH_MAX_LEN + 16], destination[PATH_MAX_LEN + 16];
+        snprintf(source, sizeof(source), "%s%s", job->staging, thumb_suffixes[i]);
+        snprintf(destination, sizeof(destination), "%s%s", job->filename, thumb_suffixes[i]);
+        if (access(source, F_OK) != 0)
+            continue;
+        if (job->copy ? copy_file(source, destination) != 0 : rename(source, destination) != 0)
+            LOG_WARN("Failed to move %s to archive\n", source);
+        unlink(source);
+    }
+
+    pthread_mutex_lock(&recordings_mutex);
+    if (result == 0) {
+        if (!ArchiveList) {
+            load_archive_list();
+        }
+        cJSON_AddItemToArray(ArchiveList, job->entry);
+        save_archive_list();
+        LOG_TRACE("%s: Archived %s\n", __func__, job->filename);
+    } else {
+        LOG_WARN("Failed to move %s to archive: %s\n", job->staging, strerror(errno));
+        cJSON_Delete(job->entry);
+    }
+    archive_jobs--;
+    pthread_cond_broadcast(&archive_cond);
+    pthread_mutex_unlock(&recordings_mutex);
+    free(job);
+    return NULL;
+}
+
 int Recordings_Archive(const char *profileID) {
     char profilePath[PATH_MAX_LEN];
     char archivePath[PATH_MAX_LEN];
     char aviFile[PATH_MAX_LEN];
-    char idxFile[PATH_MAX_LEN];
     char archiveFilename[PATH_MAX_LEN];
     
-    // Check if archiving is already in progress
-    if (!__sync_bool_compare_and_swap(&archiving_in_progress, 0, 1)) {
-        LOG_WARN("Archive already in progress\n");
-        return -1;
-    }
-    
     // Validate input
     if (!profileID) {
         LOG_WARN("Invalid profile ID\n");
-        archiving_in_progress = 0;
         return -1;
     }
+    pthread_mutex_lock(&recordings_mutex);
     
     // Setup paths
     snprintf(profilePath, sizeof(profilePath), 
@@ -743,32 +1639,38 @@ int Recordings_Archive(const char *profileID) {
     snprintf(archivePath, sizeof(archivePath), 
              "/var/spool/storage/NetworkShare/timelapse2/archive");
     snprintf(aviFile, sizeof(aviFile), "%s/timelapse.avi", profilePath);
-    snprintf(idxFile, sizeof(idxFile), "%s/timelapse.idx", profilePath);
     
     // Create archive directory
     ensure_directory(archivePath);
     
     // Get metadata before clearing anything
-    cJSON *recordingMetadata = Recordings_Get_Metadata(profileID);
+    RecordingState* recordingMetadata = g_hash_table_lookup(Recordings_State, profileID);
     if (!recordingMetadata) {
         LOG_WARN("No metadata found for profile: %s\n", profileID);
-        archiving_in_progress = 0;
+        pthread_mutex_unlock(&recordings_mutex);
         return -1;
     }
     
-    // Get profile information
-    cJSON *profile = Timelapse_Find_Profile_By_Id(profileID);
-    if (!profile) {
+    // Get profile information; the live list belongs to the main loop
+    char sanitizedProfileName[PATH_MAX_LEN] = "";
+    ACAP_Snapshot* profiles = ACAP_STATE_Get("profiles");
+    const cJSON* profile;
+    cJSON_ArrayForEach(profile, ACAP_Snapshot_JSON(profiles)) {
+        cJSON* id = cJSON_GetObjectItem(profile, "id");
+        cJSON* name = cJSON_GetObjectItem(profile, "name");
+        if (id && id->valuestring && strcmp(id->valuestring, profileID) == 0 && name && name->valuestring) {
+            snprintf(sanitizedProfileName, sizeof(sanitizedProfileName), "%s", name->valuestring);
+            break;
+        }
+    }
+    ACAP_Snapshot_Release(profiles);
+    if (!sanitizedProfileName[0]) {
         LOG_WARN("Profile not found for ID: %s\n", profileID);
-        archiving_in_progress = 0;
+        pthread_mutex_unlock(&recordings_mutex);
         return -1;
     }
     
     // Create archive filename
-    const char *profileName = cJSON_GetObjectItem(profile, "name")->valuestring;
-    char sanitizedProfileName[PATH_MAX_LEN];
-    strncpy(sanitizedProfileName, profileName, PATH_MAX_LEN - 1);
-    sanitizedProfileName[PATH_MAX_LEN - 1] = '\0';
     replace_spaces_with_underscores(sanitizedProfileName);
     
     time_t now = time(NULL);
@@ -778,66 +1680,70 @@ int Recordings_Archive(const char *profileID) {
              archivePath, sanitizedProfileName,
              timeinfo->tm_year + 1900, timeinfo->tm_mon + 1,
              timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min);
-    
-    // Create archive file
-    FILE *archiveFile = fopen(archiveFilename, "wb");
-    if (!archiveFile) {
-        LOG_WARN("Failed to create archive file: %s\n", archiveFilename);
-        archiving_in_progress = 0;
+
+    ArchiveJob* job = calloc(1, sizeof(ArchiveJob));
+    if (!job) {
+        pthread_mutex_unlock(&recordings_mutex);
         return -1;
     }
-    
-    // Copy AVI file to archive
-    FILE *src = fopen(aviFile, "rb");
-    if (!src) {
-        fclose(archiveFile);
-        unlink(archiveFilename);
-        LOG_WARN("Failed to open source AVI file: %s\n", aviFile);
-        archiving_in_progress = 0;
-        return -1;
+
+    // Rotations within the same minute get a sequence number, so neither the
+    // archive nor a file still being staged is overwritten
+    strcpy(job->filename, archiveFilename);
+    snprintf(job->staging, sizeof(job->staging), "%s.part", job->filename);
+    for (int sequence = 2; access(job->filename, F_OK) == 0 || access(job->staging, F_OK) == 0; sequence++) {
+        snprintf(job->filename, sizeof(job->filename), "%.*s_%d.avi",
+                 (int)strlen(archiveFilename) - 4, archiveFilename, sequence);
+        snprintf(job->staging, sizeof(job->staging), "%s.part", job->filename);
     }
+    strcpy(archiveFilename, job->filename);
     
-    // Copy AVI content
-    char buffer[65536];
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), src)) > 0) {
-        if (fwrite(buffer, 1, bytesRead, archiveFile) != bytesRead) {
-            fclose(src);
-            fclose(archiveFile);
-            unlink(archiveFilename);
-            LOG_WARN("Failed to write to archive file\n");
-            archiving_in_progress = 0;
-            return -1;
-        }
+    // Close the recording in place by appending its index
+    RecordingWriter* writer = writer_open(profileID, 0, 0, 0);
+    size_t tailSize = 0;
+    char* tail = writer ? writer_tail(writer, &tailSize) : NULL;
+    if (!tail) {
+        LOG_WARN("Failed to read index of recording: %s\n", profileID);
+        free(job);
+        pthread_mutex_unlock(&recordings_mutex);
+        return -1;
     }
-    fclose(src);
-    
-    // Append index file
-    FILE *idxSrc = fopen(idxFile, "rb");
-    if (!idxSrc) {
-        fclose(archiveFile);
-        unlink(archiveFilename);
-        LOG_WARN("Failed to open index file: %s\n", idxFile);
-        archiving_in_progress = 0;
+    writer_checkpoint(writer);
+    off_t aviSize = writer->avi_offset;
+    int finalized = pwrite(writer->avi_fd, tail, tailSize, aviSize) == (ssize_t)tailSize &&
+                    ftruncate(writer->avi_fd, aviSize + tailSize) == 0;
+    free(tail);
+    writer_release(profileID);
+    if (!finalized) {
+        LOG_WARN("Failed to append index to %s: %s\n", aviFile, strerror(errno));
+        truncate(aviFile, aviSize);
+        free(job);
+        pthread_mutex_unlock(&recordings_mutex);
         return -1;
     }
-    
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), idxSrc)) > 0) {
-        if (fwrite(buffer, 1, bytesRead, archiveFile) != bytesRead) {
-            fclose(idxSrc);
-            fclose(archiveFile);
-            unlink(archiveFilename);
-            LOG_WARN("Failed to append index to archive\n");
-            archiving_in_progress = 0;
+
+    // Stage next to its final name, or outside the profile directory when
+    // the archive is on another file system and the file has to be copied
+    if (rename(aviFile, job->staging) != 0) {
+        int renameError = errno;
+        snprintf(job->staging, sizeof(job->staging), 
+                 "/var/spool/storage/NetworkShare/timelapse2/%s.part", strrchr(archiveFilename, '/') + 1);
+        if (renameError != EXDEV || rename(aviFile, job->staging) != 0) {
+            LOG_WARN("Failed to stage %s for archive: %s\n", aviFile, strerror(renameError));
+            truncate(aviFile, aviSize);
+            free(job);
+            pthread_mutex_unlock(&recordings_mutex);
             return -1;
         }
+        job->copy = 1;
     }
-    fclose(idxSrc);
-    fclose(archiveFile);
-    
-    // Update archive list
-    if (!ArchiveList) {
-        load_archive_list();
+
+    // Stage the thumbnail sidecar with the AVI before the profile is cleared
+    for (int i = 0; i < 2; i++) {
+        char source[PATH_MAX_LEN + 16], destination[PATH_MAX_LEN + 16];
+        snprintf(source, sizeof(source), "%s%s", aviFile, thumb_suffixes[i]);
+        snprintf(destination, sizeof(destination), "%s%s", job->staging, thumb_suffixes[i]);
+        rename(source, destination);
     }
     
     // Create archive entry
@@ -845,35 +1751,30 @@ int Recordings_Archive(const char *profileID) {
     cJSON_AddStringToObject(recordingInfo, "id", profileID);
     cJSON_AddStringToObject(recordingInfo, "filename", 
                            strrchr(archiveFilename, '/') + 1);
-    cJSON_AddNumberToObject(recordingInfo, "size", 
-        cJSON_GetObjectItem(recordingMetadata, "size")->valuedouble);
-    cJSON_AddNumberToObject(recordingInfo, "frames", 
-        cJSON_GetObjectItem(recordingMetadata, "images")->valueint);
-    cJSON_AddNumberToObject(recordingInfo, "fps", 
-        cJSON_GetObjectItem(recordingMetadata, "fps")->valueint);
-    cJSON_AddNumberToObject(recordingInfo, "first", 
-        cJSON_GetObjectItem(recordingMetadata, "first")->valuedouble);
-    cJSON_AddNumberToObject(recordingInfo, "last", 
-        cJSON_GetObjectItem(recordingMetadata, "last")->valuedouble);
-    
-    // Add to archive list and save
-    cJSON_AddItemToArray(ArchiveList, recordingInfo);
-    save_archive_list();
+    cJSON_AddNumberToObject(recordingInfo, "size", recordingMetadata->size);
+    cJSON_AddNumberToObject(recordingInfo, "frames", recordingMetadata->images);
+    cJSON_AddNumberToObject(recordingInfo, "fps", recordingMetadata->fps ? recordingMetadata->fps : 10);
+    cJSON_AddNumberToObject(recordingInfo, "first", recordingMetadata->first);
+    cJSON_AddNumberToObject(recordingInfo, "last", recordingMetadata->last);
+    job->entry = recordingInfo;
     
     // Update profile archived timestamp
-    if (!cJSON_GetObjectItem(profile, "archived")) {
-        cJSON_AddNumberToObject(profile, "archived", ACAP_DEVICE_Timestamp());
-    } else {
-        cJSON_SetNumberValue(cJSON_GetObjectItem(profile, "archived"), 
-                            ACAP_DEVICE_Timestamp());
-    }
-    save_recordings();
+    Timelapse_Set_Archived(profileID, ACAP_DEVICE_Timestamp());
     
-    // Clear original recording
+    // Start over; the next capture creates a new recording
     Recordings_Clear(profileID);
+    archive_jobs++;
+    pthread_mutex_unlock(&recordings_mutex);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, archive_finish, job) != 0)
+        archive_finish(job);
+    pthread_attr_destroy(&attr);
     
-    LOG_TRACE("Successfully archived recording for Profile ID: %s\n", profileID);
-    archiving_in_progress = 0;
+    LOG_TRACE("Rotated recording for Profile ID: %s\n", profileID);
     return 0;
 }
 
@@ -883,6 +1784,7 @@ int Recordings_Delete_Archive(const char* filename) {
         return 0;
     }
 
+    pthread_mutex_lock(&recordings_mutex);
     // Load archive list if not loaded
     if (!ArchiveList) {
         load_archive_list();
@@ -901,6 +1803,11 @@ int Recordings_Delete_Archive(const char* filename) {
             snprintf(filepath, sizeof(filepath), 
                     "/var/spool/storage/NetworkShare/timelapse2/archive/%s", filename);
             unlink(filepath);
+            for (int i = 0; i < 2; i++) {
+                char sidecar[PATH_MAX_LEN + 16];
+                snprintf(sidecar, sizeof(sidecar), "%s%s", filepath, thumb_suffixes[i]);
+                unlink(sidecar);
+            }
         } else {
             cJSON_AddItemToArray(newArchiveList, cJSON_Duplicate(item, 1));
         }
@@ -911,11 +1818,13 @@ int Recordings_Delete_Archive(const char* filename) {
         cJSON_Delete(ArchiveList);
         ArchiveList = newArchiveList;
         save_archive_list();
+        pthread_mutex_unlock(&recordings_mutex);
         return 1;
     }
 
     // Clean up if not found
     cJSON_Delete(newArchiveList);
+    pthread_mutex_unlock(&recordings_mutex);
     return 0;
 }
 
@@ -942,80 +1851,170 @@ HTTP_Endpoint_Image(const ACAP_HTTP_Response response,
 
     int index = atoi(indexStr);
     
-    // Read frame index
-    char idxfile[PATH_MAX_LEN];
-    sprintf(idxfile, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.idx", profileId);
-    
-    FILE* idxf = fopen(idxfile, "rb");
-    if (!idxf) {
-        ACAP_HTTP_Respond_Error(response, 404, "Recording not found");
+    // Frames never change within a recording generation
+    pthread_mutex_lock(&recordings_mutex);
+    long long generation = recording_generation(profileId, NULL);
+    char etag[PATH_MAX_LEN];
+    const char* sizeStr = ACAP_HTTP_Request_Param(request, "size");
+    int thumbnail = sizeStr && strcmp(sizeStr, "thumb") == 0;
+    snprintf(etag, sizeof(etag), "\"%s-%llx-%d%s\"", profileId, generation, index, thumbnail ? "-t" : "");
+
+    // Only a URL that names the generation may be cached without revalidation
+    const char* genStr = ACAP_HTTP_Request_Param(request, "gen");
+    const char* cacheControl = genStr && generation >= 0 && atoll(genStr) == generation ?
+                               "public, max-age=31536000, immutable" : "no-cache";
+
+    if (generation >= 0 && ACAP_HTTP_Request_Match(request, etag)) {
+        pthread_mutex_unlock(&recordings_mutex);
+        ACAP_HTTP_Respond_Not_Modified(response, etag, cacheControl);
         return;
     }
 
-    // Read index header and entry
-    LIST_INDEX list_header;
-    AVI_INDEX_ENTRY entry;
-    
-    // Read index header
-    if (fread(&list_header, sizeof(LIST_INDEX), 1, idxf) != 1) {
-        fclose(idxf);
-        ACAP_HTTP_Respond_Error(response, 404, "Invalid index file");
-        return;
-    }
-    
-    // Seek to frame entry
-    fseek(idxf, sizeof(LIST_INDEX) + ((index-1) * sizeof(AVI_INDEX_ENTRY)), SEEK_SET);
-    if (fread(&entry, sizeof(AVI_INDEX_ENTRY), 1, idxf) != 1) {
-        fclose(idxf);
+    // Look up the frame in the index, or its thumbnail in the sidecar
+    off_t frame_offset;
+    DWORD frame_size;
+    RecordingWriter* writer = writer_view(profileId);
+    int found = writer_lookup(writer, index, &frame_offset, &frame_size);
+    writer_view_release(writer);
+    if (found && thumbnail)
+        thumbnail = thumb_lookup(profileId, index, &frame_offset, &frame_size);
+    pthread_mutex_unlock(&recordings_mutex);
+    if (!found) {
         ACAP_HTTP_Respond_Error(response, 404, "Frame not found");
         return;
     }
-    fclose(idxf);
 
-    LOG_TRACE("%s: Index Entry: offset=%u, size=%u\n", __func__, 
-              LILEND4(entry.offset), LILEND4(entry.size));
-
-    // Read frame from AVI
+    // Send the JPEG payload straight from the AVI, skipping the chunk
+    // header (8 bytes: '00db' + size)
     char avifile[PATH_MAX_LEN];
-    sprintf(avifile, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
-    
-    FILE* avif = fopen(avifile, "rb");
-    if (!avif) {
-        ACAP_HTTP_Respond_Error(response, 404, "Recording file not found");
-        return;
+    if (thumbnail) {
+        sprintf(avifile, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi" THUMB_SUFFIX, profileId);
+    } else {
+        sprintf(avifile, "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
+        frame_offset += sizeof(LIST_INDEX);
     }
+	LOG_TRACE("%s: File offset = %lld size=%u\n",__func__,(long long)frame_offset,frame_size);
 
-    // Calculate correct offset: AVI header + movi list header + frame offset
-	long frame_offset = sizeof(AVI_HEADER) + LILEND4(entry.offset) - 4;
-	LOG_TRACE("%s: File offset = %ld\n",__func__,frame_offset);
-	fseek(avif, frame_offset, SEEK_SET);
-
-	// Skip chunk header (8 bytes: '00db' + size)
-	fseek(avif, sizeof(LIST_INDEX), SEEK_CUR);
-
-	// Allocate buffer for actual JPEG data
-	unsigned int frame_size = LILEND4(entry.size);
-	char* buffer = malloc(frame_size);
-	if (!buffer) {
-		fclose(avif);
-		ACAP_HTTP_Respond_Error(response, 500, "Memory allocation failed");
-		return;
-	}
-
-	fread(buffer, 1, frame_size, avif);
-    fclose(avif);
-
-    ACAP_HTTP_Respond_String(response, "status: 200 OK\r\n");
+    ACAP_HTTP_Respond_String(response, "Status: 200 OK\r\n");
     ACAP_HTTP_Respond_String(response, "Content-Type: image/jpeg\r\n");
     ACAP_HTTP_Respond_String(response, "Content-Length: %u\r\n", frame_size);
+    ACAP_HTTP_Respond_String(response, "ETag: %s\r\n", etag);
+    ACAP_HTTP_Respond_String(response, "Cache-Control: %s\r\n", cacheControl);
     ACAP_HTTP_Respond_String(response, "\r\n");
 
-    int result = ACAP_HTTP_Respond_Data(response, frame_size, buffer);
-    if (result != 1) {
+    if (!ACAP_HTTP_Respond_File(response, avifile, frame_offset, frame_size, NULL)) {
         LOG_WARN("%s: Failed to send image data\n", __func__);
     }
+}
+
+/*
+ * Preview a range of a recording as multipart/x-mixed-replace, which
+ * browsers show in an <img>.  The stored JPEGs are sent as they are,
+ * straight from the movi list (or the thumbnail sidecar with size=thumb).
+ * Frames are paced at the requested fps against a fixed schedule; when the
+ * client falls behind the schedule the frames it missed are skipped.
+ */
+#define PREVIEW_BOUNDARY	"timelapseframe"
+
+static double preview_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void HTTP_Endpoint_Preview(const ACAP_HTTP_Response response,
+                                  const ACAP_HTTP_Request request) {
+    const char* method = ACAP_HTTP_Get_Method(request);
+    if (strcmp(method, "GET") != 0) {
+        ACAP_HTTP_Respond_Error(response, 405, "Method not allowed");
+        return;
+    }
 
-    free(buffer);
+    const char* profileId = ACAP_HTTP_Request_Param(request, "id");
+    if (!profileId) {
+        ACAP_HTTP_Respond_Error(response, 400, "Missing parameters");
+        return;
+    }
+    const char* fromStr = ACAP_HTTP_Request_Param(request, "from");
+    const char* toStr = ACAP_HTTP_Request_Param(request, "to");
+    const char* fpsStr = ACAP_HTTP_Request_Param(request, "fps");
+    const char* sizeStr = ACAP_HTTP_Request_Param(request, "size");
+    int thumbnail = sizeStr && strcmp(sizeStr, "thumb") == 0;
+
+    pthread_mutex_lock(&recordings_mutex);
+    unsigned int frames = 0;
+    long long generation = recording_generation(profileId, &frames);
+    RecordingState* recording = generation >= 0 ? g_hash_table_lookup(Recordings_State, profileId) : NULL;
+    int fps = recording && recording->fps ? (int)recording->fps : 10;
+    pthread_mutex_unlock(&recordings_mutex);
+
+    unsigned int from = fromStr && atoi(fromStr) > 0 ? (unsigned int)atoi(fromStr) : 1;
+    unsigned int to = toStr && atoi(toStr) > 0 ? (unsigned int)atoi(toStr) : frames;
+    if (to > frames)
+        to = frames;
+    if (fpsStr)
+        fps = atoi(fpsStr);
+    if (fps < 1) fps = 1;
+    if (fps > 60) fps = 60;
+
+    if (generation < 0 || from > to) {
+        ACAP_HTTP_Respond_Error(response, 404, "Frames not found");
+        return;
+    }
+
+    char avifile[PATH_MAX_LEN], thumbfile[PATH_MAX_LEN];
+    snprintf(avifile, sizeof(avifile), "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
+    snprintf(thumbfile, sizeof(thumbfile), "%s" THUMB_SUFFIX, avifile);
+
+    ACAP_HTTP_Respond_String(response, "Status: 200 OK\r\n");
+    ACAP_HTTP_Respond_String(response, "Content-Type: multipart/x-mixed-replace; boundary=" PREVIEW_BOUNDARY "\r\n");
+    ACAP_HTTP_Respond_String(response, "Cache-Control: no-cache\r\n");
+    ACAP_HTTP_Respond_String(response, "\r\n");
+
+    double start = preview_clock();
+    unsigned int sent = 0, skipped = 0;
+    unsigned int frame = from;
+    while (frame <= to) {
+        off_t offset;
+        DWORD size;
+        const char* path = avifile;
+        pthread_mutex_lock(&recordings_mutex);
+        RecordingWriter* writer = writer_view(profileId);
+        int found = writer_lookup(writer, frame, &offset, &size);
+        writer_view_release(writer);
+        if (found && thumbnail && thumb_lookup(profileId, frame, &offset, &size))
+            path = thumbfile;
+        else
+            offset += sizeof(LIST_INDEX);
+        pthread_mutex_unlock(&recordings_mutex);
+        if (!found)
+            break;
+
+        if (!ACAP_HTTP_Respond_String(response,
+                "--" PREVIEW_BOUNDARY "\r\n"
+                "Content-Type: image/jpeg\r\n"
+                "Content-Length: %u\r\n"
+                "\r\n", size) ||
+            !ACAP_HTTP_Respond_File(response, path, offset, size, NULL) ||
+            !ACAP_HTTP_Respond_String(response, "\r\n") ||
+            !ACAP_HTTP_Flush(response))
+            break;  // Client went away
+        sent++;
+
+        // Wait for the next slot, or skip what a slow client has missed
+        double elapsed = preview_clock() - start;
+        unsigned int due = from + (unsigned int)(elapsed * fps);
+        if (due > frame + 1) {
+            skipped += due - frame - 1;
+            frame = due;
+        } else {
+            frame++;
+            double wait = (double)(frame - from) / fps - elapsed;
+            if (wait > 0)
+                usleep((useconds_t)(wait * 1e6));
+        }
+    }
+    LOG_TRACE("%s: %s sent %u skipped %u\n", __func__, profileId, sent, skipped);
 }
 
 static void HTTP_Endpoint_Export(const ACAP_HTTP_Response response, 
@@ -1038,86 +2037,85 @@ static void HTTP_Endpoint_Export(const ACAP_HTTP_Response response,
         return;
     }
 	LOG_TRACE("%s: %s %s %s\n", __func__, profileId, filename, fpsString );
+	Recordings_Checkpoint(profileId);
 
 	int fps = atoi(fpsString);
 	if( fps < 1 ) fps = 1;
 	if (fps > 60) fps = 60;
 
-    char avipath[PATH_MAX_LEN], idxpath[PATH_MAX_LEN];
+    char avipath[PATH_MAX_LEN];
     snprintf(avipath, sizeof(avipath), 
              "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.avi", profileId);
-    snprintf(idxpath, sizeof(idxpath), 
-             "/var/spool/storage/NetworkShare/timelapse2/%s/timelapse.idx", profileId);
 
 	FILE* aviFile = fopen(avipath, "rb+");
-    FILE* idxFile = fopen(idxpath, "rb");
-    
-    if (!aviFile || !idxFile) {
-        if (aviFile) fclose(aviFile);
-        if (idxFile) fclose(idxFile);
+    if (!aviFile) {
         ACAP_HTTP_Respond_Error(response, 404, "Recording not found");
         return;
     }
 
-    cJSON* recording = cJSON_GetObjectItem(Recordings_Container, profileId);
-	if( recording ) {
-		if( !cJSON_GetObjectItem(recording,"fps") ) {
-			cJSON_AddNumberToObject(recording,"fps",fps );
-			update_avi_fps(aviFile, fps);
-			save_recordings();
-		}
-		if( cJSON_GetObjectItem(recording,"fps")->valueint != fps ) {
-			cJSON_SetNumberValue(cJSON_GetObjectItem(recording, "fps"), fps);
-			update_avi_fps(aviFile, fps);
-			save_recordings();
-		}
+    pthread_mutex_lock(&recordings_mutex);
+    RecordingState* recording = g_hash_table_lookup(Recordings_State, profileId);
+	if( recording && recording->fps != (unsigned int)fps ) {
+		recording->fps = fps;
+		update_avi_fps(aviFile, fps);
+		save_recordings();
 	}
 
-    // Get file sizes
-    fseek(aviFile, 0, SEEK_END);
-    fseek(idxFile, 0, SEEK_END);
-    long aviSize = ftell(aviFile);
-    long idxSize = ftell(idxFile);
-    long totalSize = aviSize + idxSize;
-
-    // Reset file positions
-    fseek(aviFile, 0, SEEK_SET);
-    fseek(idxFile, 0, SEEK_SET);
-	LOG_TRACE("%s: Uploading %s %ld\n",__func__,filename,totalSize);
-    // Send response headers
-    ACAP_HTTP_Respond_String(response, "status: 200 OK\r\n");
-    ACAP_HTTP_Respond_String(response, "Content-Type: video/x-msvideo\r\n");
-    ACAP_HTTP_Respond_String(response, "Content-Disposition: attachment; filename=%s\r\n", filename);
-    ACAP_HTTP_Respond_String(response, "Content-Length: %ld\r\n", totalSize);
-    ACAP_HTTP_Respond_String(response, "\r\n");
-
-    // Use larger buffer for efficient transfer
-    char* buffer = malloc(65536);
-    if (!buffer) {
+    // Take the AVI length and the closing index at the same frame count,
+    // so frames captured during the transfer do not end up half included.
+    // Only a recording being written has header fields to bring up to date
+    RecordingWriter* writer = writer_view(profileId);
+    char* idxData = NULL;
+    off_t aviSize = 0;
+    size_t idxSize = 0;
+    double last = 0;
+    if (writer) {
+        if (writer->pending)
+            writer_checkpoint(writer);
+        aviSize = writer->avi_offset;
+        idxData = writer_tail(writer, &idxSize);
+    }
+    int found = writer != NULL;
+    writer_view_release(writer);
+    if (recording)
+        last = recording->last;
+    pthread_mutex_unlock(&recordings_mutex);
+
+    if (!idxData) {
         fclose(aviFile);
-        fclose(idxFile);
-        ACAP_HTTP_Respond_Error(response, 500, "Memory allocation failed");
+        ACAP_HTTP_Respond_Error(response, found ? 500 : 404, found ? "Unable to build index" : "Recording not found");
         return;
     }
+    off_t totalSize = aviSize + idxSize;
 
-    // Send AVI file content
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, 65536, aviFile)) > 0) {
-        if (ACAP_HTTP_Respond_Data(response, bytesRead, buffer) != 1) {
-            break;  // Handle transfer interruption
-        }
+    // The body is the AVI up to the last indexed frame followed by the
+    // in-memory index, so it is identified by its size, last frame and fps
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%d\"",
+             (long long)totalSize, (long long)(last * 1000), fps);
+    long long start, end;
+    int status = ACAP_HTTP_Request_Range(request, totalSize, etag, &start, &end);
+    ACAP_HTTP_Header_Range(response, status, filename, "video/x-msvideo", etag, start, end, totalSize);
+    fclose(aviFile);
+    if (status == 416) {
+        free(idxData);
+        return;
     }
+	LOG_TRACE("%s: Uploading %s %lld-%lld/%lld\n",__func__,filename,start,end,(long long)totalSize);
 
-    // Send index file content
-    while ((bytesRead = fread(buffer, 1, 65536, idxFile)) > 0) {
-        if (ACAP_HTTP_Respond_Data(response, bytesRead, buffer) != 1) {
-            break;  // Handle transfer interruption
-        }
+    // Send the part of the range that lies in the AVI file, up to the
+    // end of the last indexed frame
+    int sent = 1;
+    if (start < aviSize)
+        sent = ACAP_HTTP_Respond_File(response, avipath, start, (end < aviSize ? end + 1 : aviSize) - start, NULL);
+
+    // Send the part of the range that lies in the index
+    if (sent && end >= aviSize) {
+        off_t idxStart = start > aviSize ? start - aviSize : 0;
+        ACAP_HTTP_Respond_Data(response, end + 1 - aviSize - idxStart, idxData + idxStart);
     }
 
-    free(buffer);
-    fclose(aviFile);
-    fclose(idxFile);
+    free(idxData);
 }
 
 static void 
@@ -1128,21 +2126,24 @@ HTTP_Endpoint_Recordings(const ACAP_HTTP_Response response,
 	LOG_TRACE("%s: %s\n",__func__,method);
     
     if (strcmp(method, "GET") == 0) {
-        if (!Recordings_Container) {
-            load_recordings();
+        // Responses are written after the lock is released, so a slow
+        // client never holds up capture
+        const char* profileId = ACAP_HTTP_Request_Param(request, "id");
+        if (!profileId) {
+            ACAP_HTTP_Respond_JSON_Cached(response, request, &recordings_cache);
+            return;
         }
 
-        const char* profileId = ACAP_HTTP_Request_Param(request, "id");
-        if (profileId) {
-            cJSON* recording = cJSON_GetObjectItem(Recordings_Container, profileId);
-            if (!recording) {
-                ACAP_HTTP_Respond_Error(response, 404, "Recording not found");
-                return;
-            }
-            ACAP_HTTP_Respond_JSON(response, recording);
-        } else {
-            ACAP_HTTP_Respond_JSON(response, Recordings_Container);
+        pthread_mutex_lock(&recordings_mutex);
+        RecordingState* state = g_hash_table_lookup(Recordings_State, profileId);
+        cJSON* recording = state ? recording_json(state) : NULL;
+        pthread_mutex_unlock(&recordings_mutex);
+        if (!recording) {
+            ACAP_HTTP_Respond_Error(response, 404, "Recording not found");
+            return;
         }
+        ACAP_HTTP_Respond_JSON(response, recording);
+        cJSON_Delete(recording);
         return;
     }
 
@@ -1171,10 +2172,7 @@ static void HTTP_Endpoint_Archive(const ACAP_HTTP_Response response,
 	LOG_TRACE("%s: %s\n",__func__,method);
     // Handle GET request: Provide the archive/recordings.json
     if (strcmp(method, "GET") == 0) {
-        if (!ArchiveList) {
-            load_archive_list();
-        }
-        ACAP_HTTP_Respond_JSON(response, ArchiveList);
+        ACAP_HTTP_Respond_JSON_Cached(response, request, &archive_cache);
         return;
     }
 
@@ -1202,10 +2200,9 @@ static void HTTP_Endpoint_Archive(const ACAP_HTTP_Response response,
             return;
         }
 
-        // Call Recordings_Archive to perform the archiving operation
+        // The archive list entry is added by archive_finish when the file is in place
         int result = Recordings_Archive(profileID);
         if (result == 0) {
-            load_archive_list(); // Reload archive list after archiving
             ACAP_HTTP_Respond_Text(response, "Recording archived successfully");
         } else {
             ACAP_HTTP_Respond_Error(response, 500, "Failed to archive recording");
@@ -1235,58 +2232,70 @@ static void HTTP_Endpoint_Download(const ACAP_HTTP_Response response,
     snprintf(filepath, sizeof(filepath), 
              "/var/spool/storage/NetworkShare/timelapse2/archive/%s", filename);
 
-    FILE* file = fopen(filepath, "rb");
-    if (!file) {
+    struct stat st;
+    if (stat(filepath, &st) != 0) {
         ACAP_HTTP_Respond_Error(response, 404, "File not found");
         return;
     }
-
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Send response headers
-    ACAP_HTTP_Respond_String(response, "status: 200 OK\r\n");
-    ACAP_HTTP_Respond_String(response, "Content-Type: video/x-msvideo\r\n");
-    ACAP_HTTP_Respond_String(response, "Content-Disposition: attachment; filename=%s\r\n", filename);
-    ACAP_HTTP_Respond_String(response, "Content-Length: %ld\r\n", fileSize);
-    ACAP_HTTP_Respond_String(response, "\r\n");
-
-    // Send file content in chunks
-    char* buffer = malloc(65536);
-    if (!buffer) {
-        fclose(file);
-        ACAP_HTTP_Respond_Error(response, 500, "Memory allocation failed");
-        return;
-    }
-
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, 65536, file)) > 0) {
-        if (ACAP_HTTP_Respond_Data(response, bytesRead, buffer) != 1) {
-            break;  // Handle transfer interruption
+    off_t fileSize = st.st_size;
+
+    // Archives are immutable; tag them by size and last frame
+    double last = 0;
+    pthread_mutex_lock(&recordings_mutex);
+    cJSON* entry = ArchiveList ? ArchiveList->child : NULL;
+    while (entry) {
+        cJSON* name = cJSON_GetObjectItem(entry, "filename");
+        if (name && name->valuestring && strcmp(name->valuestring, filename) == 0) {
+            if (cJSON_GetObjectItem(entry, "last"))
+                last = cJSON_GetObjectItem(entry, "last")->valuedouble;
+            break;
         }
+        entry = entry->next;
     }
+    pthread_mutex_unlock(&recordings_mutex);
 
-    free(buffer);
-    fclose(file);
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (long long)fileSize, (long long)(last * 1000));
+    long long start, end;
+    int status = ACAP_HTTP_Request_Range(request, fileSize, etag, &start, &end);
+    ACAP_HTTP_Header_Range(response, status, filename, "video/x-msvideo", etag, start, end, fileSize);
+    if (status == 416)
+        return;
+
+    ACAP_HTTP_Respond_File(response, filepath, start, end - start + 1, NULL);
 }
 
 void
 Recordings_Reset() {
-	if( Recordings_Container )
-		cJSON_Delete(Recordings_Container);
-	Recordings_Container = cJSON_CreateObject();
+	pthread_mutex_lock(&recordings_mutex);
+	if( Recordings_Writers )
+		g_hash_table_remove_all(Recordings_Writers);
+	g_hash_table_remove_all(Recordings_State);
 	save_recordings();
 	if( ArchiveList )
 		cJSON_Delete( ArchiveList );
 	ArchiveList = cJSON_CreateArray();
+	ACAP_JSON_Cache_Touch(&archive_cache);
+	pthread_mutex_unlock(&recordings_mutex);
 }
 
 int
 Recordings_Init(void) {
     LOG_TRACE("%s:\n", __func__);
-    Recordings_Container = load_recordings();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&recordings_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    Recordings_Writers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, writer_close);
+    Recordings_State = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    load_recordings();
+    journal_open(0);
+    if (journal_size > 0) {
+        replay_journal();
+        save_recordings();
+    }
 	load_archive_list();
 	
     // Schedule retention check at midnight
@@ -1297,8 +2306,25 @@ Recordings_Init(void) {
 	
     ACAP_HTTP_Node("recordings", HTTP_Endpoint_Recordings);
     ACAP_HTTP_Node("image", HTTP_Endpoint_Image);
-    ACAP_HTTP_Node("export", HTTP_Endpoint_Export);
+    ACAP_HTTP_Node_Stream("export", HTTP_Endpoint_Export);
     ACAP_HTTP_Node("archive", HTTP_Endpoint_Archive);
-    ACAP_HTTP_Node("download", HTTP_Endpoint_Download);
+    ACAP_HTTP_Node_Stream("download", HTTP_Endpoint_Download);
+    ACAP_HTTP_Node_Stream("preview", HTTP_Endpoint_Preview);
     return 0;
 }
+
+void
+Recordings_Cleanup(void) {
+	pthread_mutex_lock(&recordings_mutex);
+	while( archive_jobs )
+		pthread_cond_wait(&archive_cond, &recordings_mutex);
+	if( Recordings_Writers ) {
+		g_hash_table_destroy(Recordings_Writers);
+		Recordings_Writers = NULL;
+	}
+	if( journal_fd >= 0 ) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	pthread_mutex_unlock(&recordings_mutex);
+}
@@ -4,10 +4,13 @@
 #include "cJSON.h"
 
 int		Recordings_Init(void);
-int		Recordings_Capture(cJSON* profile);
+int		Recordings_Append(const char* profileId, unsigned int width, unsigned int height, unsigned int fps,
+						  double timestamp, const unsigned char* jpegData, unsigned int jpegSize,
+						  const unsigned char* thumbData, unsigned int thumbSize);
 int		Recordings_Clear(const char* profileId);
-cJSON*	Recordings_Get_List(void);
-cJSON* 	Recordings_Get_Metadata(const char* profileId);
+long long	Recordings_Generation(const char* profileId, unsigned int* frames);
+unsigned char*	Recordings_Read_Frame(const char* profileId, unsigned int index, int thumbnail, unsigned int* size);
 void	Recordings_Reset();
+void	Recordings_Cleanup(void);
 
 #endif
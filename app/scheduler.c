@@ -0,0 +1,254 @@
+/*
+ * Profile timers.  One hierarchical timing wheel holds every timer, and a
+ * single timerfd watched by the main loop is armed for the next tick that
+ * has work, so the process only wakes when something is due.  Timers that
+ * fall due on the same tick are dispatched in one wakeup.  A new timer is
+ * aligned to a multiple of its interval, which puts profiles with the same
+ * interval on the same ticks and into the same capture batch.
+ *
+ * The wheel ticks once a second.  Level 0 has a slot per tick for the next
+ * WHEEL_SIZE ticks; each higher level covers WHEEL_SIZE times the span of
+ * the one below, and a slot is moved down when its span begins.  Adding and
+ * removing a timer is constant time.  Timers run on the main loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "ACAP.h"
+#include "scheduler.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define WHEEL_BITS			6
+#define WHEEL_SIZE			(1 << WHEEL_BITS)
+#define WHEEL_MASK			(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4		// 64^4 seconds, about 194 days
+#define WHEEL_SPAN(level)	((guint64)1 << (WHEEL_BITS * (level)))
+
+struct SchedulerTimer {
+	SchedulerTimer*		next;
+	SchedulerTimer**	link;		// The pointer to this timer, NULL when not queued
+	guint64				expires;	// Tick the timer is due
+	unsigned int		interval;
+	Scheduler_Callback	callback;
+	void*				user_data;
+};
+
+static SchedulerTimer* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static guint64 wheel_tick = 0;		// Last tick handled
+static gint64 wheel_base = 0;		// Monotonic time of tick 0, microseconds
+static guint64 wheel_armed = 0;		// Tick the timerfd is set for, 0 when disarmed
+static int wheel_fd = -1;
+static guint wheel_watch = 0;
+
+// Counters for /status
+static unsigned int scheduler_timers = 0;
+static unsigned int scheduler_wakeups = 0;
+static unsigned int scheduler_dispatched = 0;
+static double scheduler_jitter = 0;		// Milliseconds the last wakeup was late
+
+static guint64
+current_tick(void) {
+	return (guint64)((g_get_monotonic_time() - wheel_base) / G_USEC_PER_SEC);
+}
+
+static void
+timer_unlink(SchedulerTimer* timer) {
+	if (!timer->link)
+		return;
+	*timer->link = timer->next;
+	if (timer->next)
+		timer->next->link = timer->link;
+	timer->next = NULL;
+	timer->link = NULL;
+}
+
+static void
+timer_push(SchedulerTimer** head, SchedulerTimer* timer) {
+	timer->next = *head;
+	if (timer->next)
+		timer->next->link = &timer->next;
+	*head = timer;
+	timer->link = head;
+}
+
+// Queue a timer in the slot for its expiry as seen from wheel_tick
+static void
+wheel_insert(SchedulerTimer* timer) {
+	if (timer->expires < wheel_tick)
+		timer->expires = wheel_tick + 1;
+	if (timer->expires - wheel_tick >= WHEEL_SPAN(WHEEL_LEVELS))
+		timer->expires = wheel_tick + WHEEL_SPAN(WHEEL_LEVELS) - 1;
+	guint64 delta = timer->expires - wheel_tick;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1))
+		level++;
+	timer_push(&wheel[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timer);
+}
+
+// Next tick with work: a level 0 slot that is due or a higher slot to move down
+static guint64
+wheel_next(void) {
+	guint64 next = G_MAXUINT64;
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		int shift = WHEEL_BITS * level;
+		guint64 base = wheel_tick >> shift;
+		// Level 0 never holds the slot of wheel_tick itself; a higher level
+		// may, for the next time its span begins
+		for (guint64 j = 1; j <= (guint64)(level ? WHEEL_SIZE : WHEEL_SIZE - 1); j++) {
+			if (wheel[level][(base + j) & WHEEL_MASK]) {
+				guint64 tick = (base + j) << shift;
+				if (tick < next)
+					next = tick;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+static void
+wheel_arm(void) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	guint64 next = scheduler_timers ? wheel_next() : G_MAXUINT64;
+	wheel_armed = next == G_MAXUINT64 ? 0 : next;
+	if (wheel_armed) {
+		gint64 due = wheel_base + (gint64)wheel_armed * G_USEC_PER_SEC;
+		spec.it_value.tv_sec = due / G_USEC_PER_SEC;
+		spec.it_value.tv_nsec = (due % G_USEC_PER_SEC) * 1000;
+	}
+	if (timerfd_settime(wheel_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+		LOG_WARN("%s: Unable to set timer: %s\n", __func__, strerror(errno));
+}
+
+// Handle one tick: move down the slots whose span begins and run what is due
+static void
+wheel_run(guint64 tick, guint64 now) {
+	wheel_tick = tick;
+	for (int level = 1; level < WHEEL_LEVELS && (tick & (WHEEL_SPAN(level) - 1)) == 0; level++) {
+		SchedulerTimer** slot = &wheel[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+		SchedulerTimer* list = *slot;
+		*slot = NULL;
+		while (list) {
+			SchedulerTimer* timer = list;
+			list = timer->next;
+			timer->next = NULL;
+			timer->link = NULL;
+			wheel_insert(timer);
+		}
+	}
+
+	// Detach the slot first; a callback may remove any timer, also the next one
+	SchedulerTimer* due = wheel[0][tick & WHEEL_MASK];
+	wheel[0][tick & WHEEL_MASK] = NULL;
+	if (due)
+		due->link = &due;
+	while (due) {
+		SchedulerTimer* timer = due;
+		timer_unlink(timer);
+		// Ticks missed while the main loop was busy are skipped, not repeated
+		timer->expires += timer->interval;
+		while (timer->expires <= now)
+			timer->expires += timer->interval;
+		wheel_insert(timer);
+		scheduler_dispatched++;
+		timer->callback(timer->user_data);
+	}
+}
+
+static gboolean
+Scheduler_Dispatch(gint fd, GIOCondition condition, gpointer user_data) {
+	guint64 expirations;
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		LOG_WARN("%s: %s\n", __func__, strerror(errno));
+
+	gint64 elapsed = g_get_monotonic_time() - wheel_base;
+	guint64 now = (guint64)(elapsed / G_USEC_PER_SEC);
+	scheduler_wakeups++;
+	if (wheel_armed && now >= wheel_armed)
+		scheduler_jitter = (elapsed - (gint64)wheel_armed * G_USEC_PER_SEC) / 1000.0;
+
+	// Jump from one tick with work to the next; the ticks between are empty
+	while (wheel_tick < now) {
+		guint64 tick = wheel_next();
+		if (tick > now) {
+			wheel_tick = now;
+			break;
+		}
+		wheel_run(tick, now);
+	}
+	wheel_arm();
+
+	ACAP_STATUS_SetNumber("scheduler", "timers", scheduler_timers);
+	ACAP_STATUS_SetNumber("scheduler", "wakeups", scheduler_wakeups);
+	ACAP_STATUS_SetNumber("scheduler", "dispatched", scheduler_dispatched);
+	ACAP_STATUS_SetNumber("scheduler", "jitter", scheduler_jitter);
+	return G_SOURCE_CONTINUE;
+}
+
+SchedulerTimer*
+Scheduler_Add(unsigned int interval, Scheduler_Callback callback, void* user_data) {
+	if (wheel_fd < 0 || !interval || !callback)
+		return NULL;
+	SchedulerTimer* timer = calloc(1, sizeof(SchedulerTimer));
+	if (!timer)
+		return NULL;
+	timer->interval = interval;
+	timer->callback = callback;
+	timer->user_data = user_data;
+
+	// An empty wheel is not kept ticking, so it starts over from now
+	guint64 now = current_tick();
+	if (!scheduler_timers)
+		wheel_tick = now;
+	timer->expires = (now / interval + 1) * interval;
+	wheel_insert(timer);
+	scheduler_timers++;
+	wheel_arm();
+	LOG_TRACE("%s: Every %us, first at tick %llu\n", __func__, interval, (unsigned long long)timer->expires);
+	return timer;
+}
+
+void
+Scheduler_Remove(SchedulerTimer* timer) {
+	if (!timer)
+		return;
+	timer_unlink(timer);
+	scheduler_timers--;
+	free(timer);
+}
+
+int
+Scheduler_Init(void) {
+	LOG_TRACE("%s:\n", __func__);
+	wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel_fd < 0) {
+		LOG_WARN("%s: Unable to create timer: %s\n", __func__, strerror(errno));
+		return 0;
+	}
+	wheel_base = g_get_monotonic_time();
+	wheel_tick = 0;
+	wheel_watch = g_unix_fd_add(wheel_fd, G_IO_IN, Scheduler_Dispatch, NULL);
+	return 1;
+}
+
+void
+Scheduler_Cleanup(void) {
+	if (wheel_watch)
+		g_source_remove(wheel_watch);
+	wheel_watch = 0;
+	if (wheel_fd >= 0)
+		close(wheel_fd);
+	wheel_fd = -1;
+}
@@ -0,0 +1,21 @@
+#ifndef _scheduler_h_
+#define _scheduler_h_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct SchedulerTimer SchedulerTimer;
+typedef void (*Scheduler_Callback)(void* user_data);
+
+int		Scheduler_Init(void);
+// Repeating timer on the main loop, every interval seconds
+SchedulerTimer*	Scheduler_Add(unsigned int interval, Scheduler_Callback callback, void* user_data);
+void	Scheduler_Remove(SchedulerTimer* timer);
+void	Scheduler_Cleanup(void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ * JPEG frame source for the capture worker.  A capture either sets up a
+ * one-shot encoder session with vdo_stream_snapshot, or pulls a frame from
+ * a persistent JPEG stream kept per (width, height, overlay).
+ *
+ * A persistent stream saves the session setup but encodes STREAM_FRAMERATE
+ * frames a second whether they are kept or not, so it only pays off when
+ * captures come nearly as often as the stream delivers.  The time between
+ * captures is tracked per entry, and a stream is used only while that gap
+ * is at most STREAM_MAX_GAP_SECONDS, which bounds the waste to a few
+ * encodes per kept frame.  Slower captures, such as profiles on timers of
+ * ten seconds or more, use one-shot snapshots and leave no encoder running.
+ * Streams not used for STREAM_IDLE_SECONDS are closed, and so is a stream
+ * that cannot be opened or delivers no frame, with the one-shot snapshot
+ * used instead.
+ *
+ * VDO calls that may block run without stream_mutex, which the main loop
+ * takes for the idle sweep; the entry is marked busy meanwhile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <glib.h>
+#include "vdo-stream.h"
+#include "vdo-frame.h"
+#include "vdo-types.h"
+#include "ACAP.h"
+#include "snapshot.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define STREAM_CACHE_SIZE		8
+#define STREAM_FRAMERATE		2.0
+#define STREAM_BUFFERS			2
+#define STREAM_MAX_AGE_US		(1000000 / STREAM_FRAMERATE)	// Oldest frame accepted from a stream
+#define STREAM_MAX_GAP_SECONDS	2.0		// Slowest capture rate served from a stream
+#define STREAM_IDLE_SECONDS		10
+#define STREAM_RETRY_SECONDS	300		// Time before a failed stream is tried again
+#define STREAM_SWEEP_SECONDS	5
+
+typedef struct {
+	unsigned int	width;
+	unsigned int	height;
+	int				overlay;
+	VdoStream*		stream;
+	time_t			used;		// Last time a frame was taken
+	time_t			failed;		// Last time the stream failed, 0 if healthy
+	gint64			last;		// Monotonic time of the last capture, microseconds
+	double			gap;		// Average seconds between captures, 0 until known
+	int				busy;		// The stream is being read or its buffer is held
+} SnapshotStream;
+
+struct SnapshotBuffer {
+	VdoBuffer*		buffer;
+	SnapshotStream*	source;		// NULL for one-shot snapshots
+};
+
+struct SnapshotSettings {
+	unsigned int	width;
+	unsigned int	height;
+	int				overlay;
+	VdoMap*			snapshot;	// For the one-shot fallback
+};
+
+static SnapshotStream stream_cache[STREAM_CACHE_SIZE];
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static VdoMap*
+snapshot_settings(unsigned int width, unsigned int height, int overlay) {
+	VdoMap* settings = vdo_map_new();
+	vdo_map_set_uint32(settings, "format", VDO_FORMAT_JPEG);
+	vdo_map_set_uint32(settings, "width", width);
+	vdo_map_set_uint32(settings, "height", height);
+	if (overlay)
+		vdo_map_set_string(settings, "overlays", "all,sync");
+	return settings;
+}
+
+static void
+stream_stop(VdoStream* stream) {
+	if (!stream)
+		return;
+	vdo_stream_stop(stream);
+	g_object_unref(stream);
+}
+
+static void
+stream_close(SnapshotStream* entry) {
+	if (!entry->stream)
+		return;
+	LOG_TRACE("%s: %ux%u overlay=%d\n", __func__, entry->width, entry->height, entry->overlay);
+	stream_stop(entry->stream);
+	entry->stream = NULL;
+}
+
+static int
+stream_open(SnapshotStream* entry) {
+	GError* error = NULL;
+
+	VdoMap* settings = snapshot_settings(entry->width, entry->height, entry->overlay);
+	vdo_map_set_double(settings, "framerate", STREAM_FRAMERATE);
+	vdo_map_set_uint32(settings, "buffer.count", STREAM_BUFFERS);
+
+	entry->stream = vdo_stream_new(settings, NULL, &error);
+	g_object_unref(settings);
+	if (!entry->stream || !vdo_stream_start(entry->stream, &error)) {
+		LOG_WARN("%s: Unable to open %ux%u stream: %s\n", __func__, entry->width, entry->height,
+				 error ? error->message : "unknown error");
+		g_clear_error(&error);
+		if (entry->stream) {
+			g_object_unref(entry->stream);
+			entry->stream = NULL;
+		}
+		entry->failed = time(NULL);
+		return 0;
+	}
+	LOG_TRACE("%s: %ux%u overlay=%d\n", __func__, entry->width, entry->height, entry->overlay);
+	entry->failed = 0;
+	return 1;
+}
+
+// Find or claim the cache entry for the capture parameters.  Call with stream_mutex held
+static SnapshotStream*
+stream_lookup(unsigned int width, unsigned int height, int overlay) {
+	SnapshotStream* free_entry = NULL;
+	SnapshotStream* oldest = NULL;
+
+	for (int i = 0; i < STREAM_CACHE_SIZE; i++) {
+		SnapshotStream* entry = &stream_cache[i];
+		if (entry->width == width && entry->height == height && entry->overlay == overlay)
+			return entry;
+		if (!entry->width) {
+			if (!free_entry)
+				free_entry = entry;
+		} else if (!entry->busy && (!oldest || entry->used < oldest->used)) {
+			oldest = entry;
+		}
+	}
+
+	SnapshotStream* entry = free_entry ? free_entry : oldest;
+	if (!entry)
+		return NULL;
+	stream_close(entry);
+	memset(entry, 0, sizeof(SnapshotStream));
+	entry->width = width;
+	entry->height = height;
+	entry->overlay = overlay;
+	return entry;
+}
+
+static VdoBuffer*
+stream_get_frame(SnapshotStream* entry) {
+	GError* error = NULL;
+
+	// Skip frames that waited in the stream buffers so the image is current
+	for (int attempt = 0; attempt <= STREAM_BUFFERS; attempt++) {
+		VdoBuffer* buffer = vdo_stream_get_buffer(entry->stream, &error);
+		if (!buffer) {
+			LOG_WARN("%s: %s\n", __func__, error ? error->message : "No buffer");
+			g_clear_error(&error);
+			return NULL;
+		}
+		gint64 age = g_get_monotonic_time() - (gint64)vdo_frame_get_timestamp(buffer);
+		if (age <= STREAM_MAX_AGE_US || attempt == STREAM_BUFFERS)
+			return buffer;
+		vdo_stream_buffer_unref(entry->stream, &buffer, NULL);
+	}
+	return NULL;
+}
+
+SnapshotSettings*
+Snapshot_Settings_New(unsigned int width, unsigned int height, int overlay) {
+	SnapshotSettings* settings = calloc(1, sizeof(SnapshotSettings));
+	if (!settings)
+		return NULL;
+	settings->width = width;
+	settings->height = height;
+	settings->overlay = overlay;
+	settings->snapshot = snapshot_settings(width, height, overlay);
+	return settings;
+}
+
+void
+Snapshot_Settings_Free(SnapshotSettings* settings) {
+	if (!settings)
+		return;
+	g_object_unref(settings->snapshot);
+	free(settings);
+}
+
+SnapshotBuffer*
+Snapshot_Capture(const SnapshotSettings* settings) {
+	if (!settings)
+		return NULL;
+	SnapshotBuffer* snapshot = calloc(1, sizeof(SnapshotBuffer));
+	if (!snapshot)
+		return NULL;
+
+	time_t now = time(NULL);
+	VdoStream* unused = NULL;
+	pthread_mutex_lock(&stream_mutex);
+	SnapshotStream* entry = stream_lookup(settings->width, settings->height, settings->overlay);
+	if (entry && !entry->busy) {
+		gint64 monotonic = g_get_monotonic_time();
+		if (entry->last) {
+			double gap = (monotonic - entry->last) / 1000000.0;
+			entry->gap = entry->gap > 0 ? (entry->gap + gap) / 2 : gap;
+		}
+		entry->last = monotonic;
+		entry->used = now;
+		if (entry->gap > 0 && entry->gap <= STREAM_MAX_GAP_SECONDS) {
+			if (entry->stream || !entry->failed || now - entry->failed >= STREAM_RETRY_SECONDS)
+				entry->busy = 1;
+		} else {
+			// Too slow for a stream to pay off
+			unused = entry->stream;
+			entry->stream = NULL;
+		}
+	} else {
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&stream_mutex);
+	stream_stop(unused);
+
+	if (entry && entry->busy) {
+		// The entry is ours while busy; open and read it without the lock
+		if (!entry->stream)
+			stream_open(entry);
+		VdoBuffer* buffer = entry->stream ? stream_get_frame(entry) : NULL;
+		pthread_mutex_lock(&stream_mutex);
+		if (buffer) {
+			snapshot->buffer = buffer;
+			snapshot->source = entry;
+		} else {
+			unused = entry->stream;
+			entry->stream = NULL;
+			entry->failed = now;
+			entry->busy = 0;
+		}
+		pthread_mutex_unlock(&stream_mutex);
+		stream_stop(unused);
+	}
+
+	if (snapshot->buffer)
+		return snapshot;
+
+	// Fall back to a one-shot snapshot
+	GError* error = NULL;
+	snapshot->buffer = vdo_stream_snapshot(settings->snapshot, &error);
+	if (!snapshot->buffer) {
+		LOG_WARN("%s: Snapshot capture failed: %s\n", __func__, error ? error->message : "unknown error");
+		g_clear_error(&error);
+		free(snapshot);
+		return NULL;
+	}
+	return snapshot;
+}
+
+unsigned char*
+Snapshot_Data(SnapshotBuffer* snapshot) {
+	return snapshot ? vdo_buffer_get_data(snapshot->buffer) : NULL;
+}
+
+unsigned int
+Snapshot_Size(SnapshotBuffer* snapshot) {
+	return snapshot ? vdo_frame_get_size(snapshot->buffer) : 0;
+}
+
+void
+Snapshot_Release(SnapshotBuffer* snapshot) {
+	if (!snapshot)
+		return;
+	if (snapshot->source) {
+		pthread_mutex_lock(&stream_mutex);
+		vdo_stream_buffer_unref(snapshot->source->stream, &snapshot->buffer, NULL);
+		snapshot->source->busy = 0;
+		pthread_mutex_unlock(&stream_mutex);
+	} else {
+		g_object_unref(snapshot->buffer);
+	}
+	free(snapshot);
+}
+
+// Close streams that have not delivered a frame for a while
+static gboolean
+Snapshot_Sweep_Timer(gpointer user_data) {
+	time_t now = time(NULL);
+	pthread_mutex_lock(&stream_mutex);
+	for (int i = 0; i < STREAM_CACHE_SIZE; i++) {
+		SnapshotStream* entry = &stream_cache[i];
+		if (!entry->busy && entry->stream && now - entry->used >= STREAM_IDLE_SECONDS)
+			stream_close(entry);
+	}
+	pthread_mutex_unlock(&stream_mutex);
+	return G_SOURCE_CONTINUE;
+}
+
+int
+Snapshot_Init(void) {
+	memset(stream_cache, 0, sizeof(stream_cache));
+	GSource* sweep_timer = g_timeout_source_new_seconds(STREAM_SWEEP_SECONDS);
+	g_source_set_callback(sweep_timer, Snapshot_Sweep_Timer, NULL, NULL);
+	g_source_attach(sweep_timer, NULL);
+	return 1;
+}
+
+void
+Snapshot_Cleanup(void) {
+	pthread_mutex_lock(&stream_mutex);
+	for (int i = 0; i < STREAM_CACHE_SIZE; i++)
+		stream_close(&stream_cache[i]);
+	pthread_mutex_unlock(&stream_mutex);
+}
@@ -0,0 +1,25 @@
+#ifndef _snapshot_h_
+#define _snapshot_h_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct SnapshotBuffer SnapshotBuffer;
+typedef struct SnapshotSettings SnapshotSettings;
+
+int				Snapshot_Init(void);
+// Capture parameters with their VDO settings, built once and reused
+SnapshotSettings*	Snapshot_Settings_New(unsigned int width, unsigned int height, int overlay);
+void			Snapshot_Settings_Free(SnapshotSettings* settings);
+SnapshotBuffer*	Snapshot_Capture(const SnapshotSettings* settings);
+unsigned char*	Snapshot_Data(SnapshotBuffer* snapshot);
+unsigned int	Snapshot_Size(SnapshotBuffer* snapshot);
+void			Snapshot_Release(SnapshotBuffer* snapshot);
+void			Snapshot_Cleanup(void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
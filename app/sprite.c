@@ -0,0 +1,502 @@
+/*
+ * Contact sheets for scrubbing.  /sprite tiles a run of frames of a
+ * recording into one JPEG, so a viewer needs one request per sheet instead
+ * of one per frame.  Each tile is decoded from the frame thumbnail when it
+ * covers the tile, otherwise from the frame, with libjpeg DCT scaling at the
+ * largest reduction that still covers the tile.  The tiles are spread over
+ * worker threads, and the finished sheet is cached in the profile directory
+ * under the recording generation.  Clearing or archiving a recording
+ * removes the profile directory content, and with it the cached sheets.
+ *
+ * The RGB canvas is the large allocation, so one sheet is built at a time
+ * and its size is capped.  A request that would wait for another build gets
+ * 503 with Retry-After instead, so it does not hold a streaming slot that
+ * exports and previews need.  A profile keeps at most SPRITE_CACHE_MAX
+ * sheets; the least recently served go first, and sheets of older
+ * generations are removed when a new one is written.  Cached sheets are
+ * served from a descriptor opened before the headers, so a trim in another
+ * request cannot pull the file away mid-response.
+ *
+ * GET sprite?id=<profile>&from=<first frame>&count=<frames>&cols=<columns>
+ *     [&width=<tile width>][&format=json]
+ *
+ * format=json returns the tile map instead of the image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+#include "ACAP.h"
+#include "cJSON.h"
+#include "recordings.h"
+#include "sprite.h"
+
+#define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
+//#define LOG_TRACE(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
+#define LOG_TRACE(fmt, args...)    {}
+
+#define SPRITE_PATH_LEN			1024
+#define SPRITE_COUNT			100		// Default frames per sheet
+#define SPRITE_MAX_COUNT		400
+#define SPRITE_COLS				10
+#define SPRITE_MAX_COLS			40
+#define SPRITE_TILE_WIDTH		160
+#define SPRITE_MIN_TILE_WIDTH	32
+#define SPRITE_MAX_TILE_WIDTH	320
+#define SPRITE_MAX_PIXELS		(2048 * 2048)	// 12 MB of RGB while building
+#define SPRITE_MAX_THREADS		4
+#define SPRITE_QUALITY			75
+#define SPRITE_CACHE_MAX		32		// Cached sheets per profile
+#define SPRITE_RETRY_SECONDS	2		// Retry-After while another sheet is built
+#define SPRITE_DIR				"/var/spool/storage/NetworkShare/timelapse2"
+
+typedef struct {
+	const char*		profileId;
+	unsigned int	from;
+	unsigned int	count;
+	unsigned int	cols;
+	unsigned int	tileWidth;
+	unsigned int	tileHeight;
+	unsigned int	width;		// Sheet size in pixels
+	unsigned int	height;
+	unsigned char*	pixels;		// RGB sheet; tiles never overlap, so workers write without locking
+	unsigned int	next;		// Next tile to decode, protected by mutex
+	pthread_mutex_t	mutex;
+} SpriteJob;
+
+typedef struct {
+	struct jpeg_error_mgr	pub;
+	jmp_buf					jump;
+} SpriteError;
+
+typedef struct {
+	char	name[256];
+	time_t	used;		// mtime, refreshed each time the sheet is served
+} SpriteCached;
+
+// Held while a sheet is built and while the cache is trimmed
+static pthread_mutex_t sprite_build_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+sprite_error_exit(j_common_ptr cinfo) {
+	SpriteError* error = (SpriteError*)cinfo->err;
+	longjmp(error->jump, 1);
+}
+
+// Read the dimensions of a frame without decoding it
+static int
+sprite_frame_size(const unsigned char* jpeg, unsigned int size, unsigned int* width, unsigned int* height) {
+	struct jpeg_decompress_struct cinfo;
+	SpriteError error;
+
+	cinfo.err = jpeg_std_error(&error.pub);
+	error.pub.error_exit = sprite_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*)jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+	jpeg_destroy_decompress(&cinfo);
+	return *width > 0 && *height > 0;
+}
+
+// Decode one frame into its tile.  A frame that cannot be read stays black
+static void
+sprite_tile(SpriteJob* job, unsigned int tile) {
+	struct jpeg_decompress_struct cinfo;
+	SpriteError error;
+	unsigned char* volatile row = NULL;
+	unsigned int size, width, height;
+
+	// The thumbnail is enough unless it is smaller than the tile
+	unsigned char* jpeg = Recordings_Read_Frame(job->profileId, job->from + tile, 1, &size);
+	if (jpeg && (!sprite_frame_size(jpeg, size, &width, &height) || width < job->tileWidth || height < job->tileHeight)) {
+		free(jpeg);
+		jpeg = Recordings_Read_Frame(job->profileId, job->from + tile, 0, &size);
+	}
+	if (!jpeg)
+		return;
+
+	cinfo.err = jpeg_std_error(&error.pub);
+	error.pub.error_exit = sprite_error_exit;
+	if (setjmp(error.jump)) {
+		LOG_WARN("%s: Frame %u of %s could not be decoded\n", __func__, job->from + tile, job->profileId);
+		jpeg_destroy_decompress(&cinfo);
+		free(row);
+		free(jpeg);
+		return;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	// Largest DCT reduction that still covers the tile
+	unsigned int denom = 8;
+	while (denom > 1 && (cinfo.image_width / denom < job->tileWidth || cinfo.image_height / denom < job->tileHeight))
+		denom /= 2;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&cinfo);
+
+	unsigned int outWidth = cinfo.output_width;
+	unsigned int outHeight = cinfo.output_height;
+	row = malloc(outWidth * cinfo.output_components);
+	if (!row) {
+		jpeg_abort_decompress(&cinfo);
+		jpeg_destroy_decompress(&cinfo);
+		free(jpeg);
+		return;
+	}
+
+	// Nearest neighbour from the scaled decode into the tile
+	unsigned char* origin = job->pixels +
+		((size_t)(tile / job->cols) * job->tileHeight * job->width + (tile % job->cols) * job->tileWidth) * 3;
+	unsigned int ty = 0;
+	while (cinfo.output_scanline < outHeight) {
+		unsigned int sy = cinfo.output_scanline;
+		JSAMPROW rows[1] = { row };
+		jpeg_read_scanlines(&cinfo, rows, 1);
+		for (; ty < job->tileHeight && (size_t)ty * outHeight / job->tileHeight == sy; ty++) {
+			unsigned char* out = origin + (size_t)ty * job->width * 3;
+			for (unsigned int tx = 0; tx < job->tileWidth; tx++)
+				memcpy(out + tx * 3, row + ((size_t)tx * outWidth / job->tileWidth) * 3, 3);
+		}
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(row);
+	free(jpeg);
+}
+
+static void*
+sprite_worker(void* arg) {
+	SpriteJob* job = (SpriteJob*)arg;
+	while (1) {
+		pthread_mutex_lock(&job->mutex);
+		unsigned int tile = job->next++;
+		pthread_mutex_unlock(&job->mutex);
+		if (tile >= job->count)
+			break;
+		sprite_tile(job, tile);
+	}
+	return NULL;
+}
+
+static unsigned char*
+sprite_encode(SpriteJob* job, unsigned long* size) {
+	struct jpeg_compress_struct cinfo;
+	SpriteError error;
+	unsigned char* volatile jpeg = NULL;
+
+	*size = 0;
+	cinfo.err = jpeg_std_error(&error.pub);
+	error.pub.error_exit = sprite_error_exit;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		free(jpeg);
+		return NULL;
+	}
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, (unsigned char**)&jpeg, size);
+	cinfo.image_width = job->width;
+	cinfo.image_height = job->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, SPRITE_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW rows[1] = { job->pixels + (size_t)cinfo.next_scanline * job->width * 3 };
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return jpeg;
+}
+
+// Decode all tiles on up to SPRITE_MAX_THREADS threads, including the caller
+static unsigned char*
+sprite_build(SpriteJob* job, unsigned long* size) {
+	job->pixels = calloc((size_t)job->width * job->height, 3);
+	if (!job->pixels)
+		return NULL;
+	job->next = 0;
+	pthread_mutex_init(&job->mutex, NULL);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int threads = cores > 0 ? (unsigned int)cores : 1;
+	if (threads > SPRITE_MAX_THREADS)
+		threads = SPRITE_MAX_THREADS;
+	if (threads > job->count)
+		threads = job->count;
+
+	pthread_t workers[SPRITE_MAX_THREADS];
+	unsigned int started = 0;
+	while (started + 1 < threads && pthread_create(&workers[started], NULL, sprite_worker, job) == 0)
+		started++;
+	sprite_worker(job);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&job->mutex);
+
+	unsigned char* jpeg = sprite_encode(job, size);
+	free(job->pixels);
+	job->pixels = NULL;
+	return jpeg;
+}
+
+static int
+sprite_cached_compare(const void* a, const void* b) {
+	time_t x = ((const SpriteCached*)a)->used, y = ((const SpriteCached*)b)->used;
+	return x < y ? -1 : x > y;
+}
+
+// Remove sheets of other generations and the least recently used beyond SPRITE_CACHE_MAX
+static void
+sprite_cache_trim(const char* profileId, long long generation) {
+	char dir[SPRITE_PATH_LEN];
+	snprintf(dir, sizeof(dir), SPRITE_DIR "/%s", profileId);
+	DIR* d = opendir(dir);
+	if (!d)
+		return;
+
+	SpriteCached* sheets = NULL;
+	unsigned int count = 0, allocated = 0;
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		unsigned long long sheetGeneration;
+		size_t length = strlen(entry->d_name);
+		if (strncmp(entry->d_name, "sprite_", 7) != 0 || length < 4 ||
+			strcmp(entry->d_name + length - 4, ".jpg") != 0 ||		// Skips sheets being written
+			length >= sizeof(sheets->name) ||
+			sscanf(entry->d_name, "sprite_%llx_", &sheetGeneration) != 1)
+			continue;
+
+		char path[SPRITE_PATH_LEN + 256];
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		struct stat st;
+		if ((long long)sheetGeneration != generation || stat(path, &st) != 0) {
+			unlink(path);
+			continue;
+		}
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : SPRITE_CACHE_MAX * 2;
+			SpriteCached* grown = realloc(sheets, allocated * sizeof(SpriteCached));
+			if (!grown)
+				break;
+			sheets = grown;
+		}
+		strcpy(sheets[count].name, entry->d_name);
+		sheets[count].used = st.st_mtime;
+		count++;
+	}
+	closedir(d);
+
+	if (count > SPRITE_CACHE_MAX) {
+		qsort(sheets, count, sizeof(SpriteCached), sprite_cached_compare);
+		for (unsigned int i = 0; i < count - SPRITE_CACHE_MAX; i++) {
+			char path[SPRITE_PATH_LEN + 256];
+			snprintf(path, sizeof(path), "%s/%s", dir, sheets[i].name);
+			unlink(path);
+		}
+	}
+	free(sheets);
+}
+
+// Open a cached sheet and mark it used.  Returns the descriptor, or -1 when not cached
+static int
+sprite_cache_open(const char* path, unsigned long* size) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	futimens(fd, NULL);
+	return fd;
+}
+
+static unsigned int
+sprite_param(const ACAP_HTTP_Request request, const char* name, unsigned int fallback, unsigned int min, unsigned int max) {
+	const char* value = ACAP_HTTP_Request_Param(request, name);
+	int number = value ? atoi(value) : (int)fallback;
+	if (number < (int)min)
+		number = min;
+	if (number > (int)max)
+		number = max;
+	return number;
+}
+
+static void
+HTTP_Endpoint_Sprite(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+	if (!method || strcmp(method, "GET") != 0) {
+		ACAP_HTTP_Respond_Error(response, 405, "Method not allowed");
+		return;
+	}
+
+	const char* profileId = ACAP_HTTP_Request_Param(request, "id");
+	if (!profileId || strchr(profileId, '/')) {
+		ACAP_HTTP_Respond_Error(response, 400, "Missing parameters");
+		return;
+	}
+
+	SpriteJob job = {0};
+	job.profileId = profileId;
+	job.from = sprite_param(request, "from", 1, 1, 0x7fffffff);
+	job.count = sprite_param(request, "count", SPRITE_COUNT, 1, SPRITE_MAX_COUNT);
+	job.cols = sprite_param(request, "cols", SPRITE_COLS, 1, SPRITE_MAX_COLS);
+	job.tileWidth = sprite_param(request, "width", SPRITE_TILE_WIDTH, SPRITE_MIN_TILE_WIDTH, SPRITE_MAX_TILE_WIDTH);
+
+	unsigned int frames;
+	long long generation = Recordings_Generation(profileId, &frames);
+	if (generation < 0 || job.from > frames) {
+		ACAP_HTTP_Respond_Error(response, 404, "Frames not found");
+		return;
+	}
+	if (job.count > frames - job.from + 1)
+		job.count = frames - job.from + 1;
+	if (job.cols > job.count)
+		job.cols = job.count;
+
+	// Tile height follows the aspect ratio of the first frame
+	unsigned int size, frameWidth = 0, frameHeight = 0;
+	unsigned char* first = Recordings_Read_Frame(profileId, job.from, 1, &size);
+	if (!first || !sprite_frame_size(first, size, &frameWidth, &frameHeight)) {
+		free(first);
+		ACAP_HTTP_Respond_Error(response, 500, "Unable to read frame");
+		return;
+	}
+	free(first);
+	job.tileHeight = job.tileWidth * frameHeight / frameWidth;
+	if (job.tileHeight < 1)
+		job.tileHeight = 1;
+	job.width = job.cols * job.tileWidth;
+	job.height = ((job.count + job.cols - 1) / job.cols) * job.tileHeight;
+	if ((size_t)job.width * job.height > SPRITE_MAX_PIXELS) {
+		ACAP_HTTP_Respond_Error(response, 400, "Sprite too large");
+		return;
+	}
+
+	if (ACAP_HTTP_Request_Param(request, "format") &&
+		strcmp(ACAP_HTTP_Request_Param(request, "format"), "json") == 0) {
+		cJSON* map = cJSON_CreateObject();
+		cJSON_AddStringToObject(map, "id", profileId);
+		cJSON_AddNumberToObject(map, "generation", generation);
+		cJSON_AddNumberToObject(map, "from", job.from);
+		cJSON_AddNumberToObject(map, "count", job.count);
+		cJSON_AddNumberToObject(map, "cols", job.cols);
+		cJSON_AddNumberToObject(map, "tileWidth", job.tileWidth);
+		cJSON_AddNumberToObject(map, "tileHeight", job.tileHeight);
+		cJSON_AddNumberToObject(map, "width", job.width);
+		cJSON_AddNumberToObject(map, "height", job.height);
+		cJSON* tiles = cJSON_AddArrayToObject(map, "tiles");
+		for (unsigned int i = 0; i < job.count; i++) {
+			cJSON* tile = cJSON_CreateObject();
+			cJSON_AddNumberToObject(tile, "index", job.from + i);
+			cJSON_AddNumberToObject(tile, "x", (i % job.cols) * job.tileWidth);
+			cJSON_AddNumberToObject(tile, "y", (i / job.cols) * job.tileHeight);
+			cJSON_AddItemToArray(tiles, tile);
+		}
+		ACAP_HTTP_Respond_JSON(response, map);
+		cJSON_Delete(map);
+		return;
+	}
+
+	// A sheet never changes within a recording generation
+	char etag[SPRITE_PATH_LEN];
+	snprintf(etag, sizeof(etag), "\"%s-%llx-s%u-%u-%u-%u\"",
+			 profileId, generation, job.from, job.count, job.cols, job.tileWidth);
+	const char* genStr = ACAP_HTTP_Request_Param(request, "gen");
+	const char* cacheControl = genStr && atoll(genStr) == generation ?
+							   "public, max-age=31536000, immutable" : "no-cache";
+	if (ACAP_HTTP_Request_Match(request, etag)) {
+		ACAP_HTTP_Respond_Not_Modified(response, etag, cacheControl);
+		return;
+	}
+
+	char path[SPRITE_PATH_LEN];
+	snprintf(path, sizeof(path), SPRITE_DIR "/%s/sprite_%llx_%u_%u_%u_%u.jpg",
+			 profileId, generation, job.from, job.count, job.cols, job.tileWidth);
+
+	unsigned char* jpeg = NULL;
+	unsigned long jpegSize = 0;
+	int cachedFd = sprite_cache_open(path, &jpegSize);
+	if (cachedFd < 0) {
+		if (pthread_mutex_trylock(&sprite_build_mutex) != 0) {
+			ACAP_HTTP_Respond_String(response,
+				"Status: 503 Service Unavailable\r\n"
+				"Retry-After: %d\r\n"
+				"Content-Type: text/plain\r\n"
+				"\r\n"
+				"Another sprite is being built", SPRITE_RETRY_SECONDS);
+			return;
+		}
+		// Another request may have built it before this one took the lock
+		cachedFd = sprite_cache_open(path, &jpegSize);
+		if (cachedFd >= 0)
+			pthread_mutex_unlock(&sprite_build_mutex);
+	}
+	if (cachedFd < 0) {
+		jpeg = sprite_build(&job, &jpegSize);
+		if (!jpeg) {
+			pthread_mutex_unlock(&sprite_build_mutex);
+			ACAP_HTTP_Respond_Error(response, 500, "Unable to build sprite");
+			return;
+		}
+
+		// Publish the cached sheet atomically
+		char tmp[SPRITE_PATH_LEN + 8];
+		snprintf(tmp, sizeof(tmp), "%s.%lx", path, (unsigned long)pthread_self());
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			int written = write(fd, jpeg, jpegSize) == (ssize_t)jpegSize;
+			close(fd);
+			if (!written || rename(tmp, path) != 0)
+				unlink(tmp);
+		}
+		sprite_cache_trim(profileId, generation);
+		pthread_mutex_unlock(&sprite_build_mutex);
+	}
+
+	ACAP_HTTP_Respond_String(response, "Status: 200 OK\r\n");
+	ACAP_HTTP_Respond_String(response, "Content-Type: image/jpeg\r\n");
+	ACAP_HTTP_Respond_String(response, "Content-Length: %lu\r\n", jpegSize);
+	ACAP_HTTP_Respond_String(response, "ETag: %s\r\n", etag);
+	ACAP_HTTP_Respond_String(response, "Cache-Control: %s\r\n", cacheControl);
+	ACAP_HTTP_Respond_String(response, "\r\n");
+	if (jpeg) {
+		ACAP_HTTP_Respond_Data(response, jpegSize, jpeg);
+		free(jpeg);
+	} else {
+		ACAP_HTTP_Respond_FD(response, cachedFd, 0, jpegSize);
+		close(cachedFd);
+	}
+}
+
+int
+Sprite_Init(void) {
+	LOG_TRACE("%s:\n", __func__);
+	// Building a sheet takes a while; keep it off the short-request path
+	return ACAP_HTTP_Node_Stream("sprite", HTTP_Endpoint_Sprite);
+}
@@ -0,0 +1,14 @@
+#ifndef _sprite_h_
+#define _sprite_h_
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+int		Sprite_Init(void);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,7 @@
 #include <glib.h>
 #include "ACAP.h"
 #include "cJSON.h"
+#include "sunevents.h"
 
 #define LOG(fmt, args...) { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
 #define LOG_WARN(fmt, args...) { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
@@ -14,12 +15,35 @@
 #define LOG_TRACE(fmt, args...) {}
 
 static cJSON* SunEventsSettings = NULL;
-static GSource* midnight_timer = NULL;
-static GSource* sunnoon_timer = NULL;
-static time_t last_scheduled_noon = 0;
+static ACAP_JSON_Cache sunevents_cache = { .root = &SunEventsSettings };
+
+/*
+ * The phase of the day is kept current by a timer, so condition checks on
+ * every capture are a single load.  Each phase is also a stateful event that
+ * profiles and action rules can use, and fires only when the phase changes.
+ * Phase, transitions and timers belong to the main loop.
+ */
+#define PHASE_CHECK_SECONDS		300		// Longest wait between phase checks
+
+static const struct {
+    const char* id;
+    const char* name;
+} sun_phase_events[] = {
+    { "night", "Night" },
+    { "dawn", "Dawn" },
+    { "day", "Daylight" },
+    { "dusk", "Dusk" }
+};
+static SunPhase sun_phase = SUN_NIGHT;
+static time_t sun_transitions[4] = {0};	// Today's dawn, sunrise, sunset and dusk
+static GSource* phase_timer = NULL;
+static int sun_phase_fired = 0;			// The phase events have been set once
+static time_t sun_day = 0;				// Local midnight of the day the transitions belong to
+static time_t sun_noon = 0;
+static int sun_noon_fired = 0;
 
 static void Calculate_Sun_Events(double lat, double lon);
-static void Setup_Midnight_Timer();
+static void Setup_Phase_Timer();
 
 static double to_rad(double deg) {
     return deg * M_PI / 180.0;
@@ -29,78 +53,108 @@ static double to_deg(double rad) {
     return rad * 180.0 / M_PI;
 }
 
-// Timer callback for solar noon
-static gboolean SunNoon_Timer_Callback(gpointer user_data) {
-    LOG_TRACE("%s: Sun noon event triggered\n", __func__);
-    ACAP_EVENTS_Fire("sunnoon");
-    return G_SOURCE_REMOVE;  // Return NULL instead of continuing
+// Hours from solar noon until the sun reaches the zenith angle.  Clamped to
+// 12 when it stays above it all day (polar day) and 0 when it never rises
+// that far (polar night), where acos would otherwise return NaN.
+static double hour_angle_hours(double zenith, double lat_rad, double decl_rad) {
+    double x = cos(to_rad(zenith)) / (cos(lat_rad) * cos(decl_rad)) -
+               tan(lat_rad) * tan(decl_rad);
+    if (x < -1)
+        x = -1;
+    if (x > 1)
+        x = 1;
+    return to_deg(acos(x)) / 15.0;
 }
 
-
-static void Setup_SunNoon_Timer(time_t noon) {
-    time_t now;
-    time(&now);
-    int seconds_to_noon = (int)(noon - now);
-    
-    if (seconds_to_noon < 0) {
-        seconds_to_noon += 24 * 3600;
-    }
-    
-    LOG_TRACE("%s: Input %d\n", __func__, seconds_to_noon);
-    
-    // Always clean up existing timer
-    if (sunnoon_timer) {
-        g_source_destroy(sunnoon_timer);
-        g_source_unref(sunnoon_timer);
-        sunnoon_timer = NULL;
-    }
-    
-    LOG_TRACE("%s: Timer to sun noon %d\n", __func__, seconds_to_noon);
-    sunnoon_timer = g_timeout_source_new_seconds(seconds_to_noon);
-    g_source_set_callback(sunnoon_timer, SunNoon_Timer_Callback, NULL, NULL);
-    g_source_attach(sunnoon_timer, NULL);
+// Keep a transition within today; twilight may run past midnight in summer
+static time_t clamp_day(time_t t, time_t midnight) {
+    if (t < midnight)
+        return midnight;
+    if (t > midnight + 24 * 3600)
+        return midnight + 24 * 3600;
+    return t;
 }
 
+static SunPhase Sun_Phase_At(time_t t) {
+    if (t < sun_transitions[0] || t >= sun_transitions[3])
+        return SUN_NIGHT;
+    if (t < sun_transitions[1])
+        return SUN_DAWN;
+    if (t < sun_transitions[2])
+        return SUN_DAY;
+    return SUN_DUSK;
+}
 
+// Local midnight that starts the day of t, and the one that ends it
+static time_t Local_Midnight(time_t t, int next) {
+    struct tm local;
+    if (!localtime_r(&t, &local))
+        return 0;
+    local.tm_mday += next;
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    return mktime(&local);
+}
 
-// Setup timer for next midnight
-static gboolean Midnight_Timer_Callback(gpointer user_data) {
-    LOG_TRACE("%s: Midnight timer triggered\n", __func__);
-    double lat = cJSON_GetObjectItem(SunEventsSettings, "lat")->valuedouble;
-    double lon = cJSON_GetObjectItem(SunEventsSettings, "lon")->valuedouble;
-    Calculate_Sun_Events(lat, lon);
-	Setup_Midnight_Timer();
-    return G_SOURCE_REMOVE;  // Return NULL instead of continuing
+static gboolean Phase_Timer_Callback(gpointer user_data) {
+    Setup_Phase_Timer();
+    return G_SOURCE_REMOVE;
 }
 
-static void Setup_Midnight_Timer() {
-    if (!SunEventsSettings) return;
-    
+// Enter the phase for the current time and check again at the next
+// transition, solar noon or midnight, but at least every PHASE_CHECK_SECONDS.
+// The wait runs on the monotonic clock and the transitions are wall-clock
+// times, so a clock step or a timezone change is caught at the next check
+// rather than hours later.  A check on another day recalculates the day.
+static void Setup_Phase_Timer() {
     time_t now;
     time(&now);
-    struct tm* local = localtime(&now);
-    int seconds_to_midnight = ((23 - local->tm_hour) * 3600) + 
-                            ((59 - local->tm_min) * 60) + 
-                            (60 - local->tm_sec);
-    
-    LOG_TRACE("%s: Setting up timer for %d seconds\n", __func__, seconds_to_midnight);
-    
-    if (midnight_timer) {
-        g_source_destroy(midnight_timer);
-        g_source_unref(midnight_timer);
-        midnight_timer = NULL;
+
+    if (phase_timer) {
+        g_source_destroy(phase_timer);
+        g_source_unref(phase_timer);
+        phase_timer = NULL;
     }
-    
-    midnight_timer = g_timeout_source_new_seconds(seconds_to_midnight);
-    if (!midnight_timer) {
-        LOG_WARN("%s: Failed to create timer source\n", __func__);
-        return;
+
+    if (SunEventsSettings && sun_day && Local_Midnight(now, 0) != sun_day) {
+        double lat = cJSON_GetObjectItem(SunEventsSettings, "lat")->valuedouble;
+        double lon = cJSON_GetObjectItem(SunEventsSettings, "lon")->valuedouble;
+        Calculate_Sun_Events(lat, lon);		// Sets up the timer for the new day
+        if (phase_timer)
+            return;
     }
-    
-    g_source_set_callback(midnight_timer, Midnight_Timer_Callback, NULL, NULL);
-    g_source_attach(midnight_timer, NULL);
-}
 
+    SunPhase phase = Sun_Phase_At(now);
+    if (!sun_phase_fired || phase != sun_phase) {
+        sun_phase = phase;
+        sun_phase_fired = 1;
+        for (int i = 0; i < 4; i++)
+            ACAP_EVENTS_Fire_State(sun_phase_events[i].id, i == (int)sun_phase);
+        LOG_TRACE("%s: Phase %s\n", __func__, sun_phase_events[sun_phase].id);
+    }
+    if (!sun_noon_fired && sun_noon && now >= sun_noon) {
+        sun_noon_fired = 1;
+        ACAP_EVENTS_Fire("sunnoon");
+    }
+
+    time_t wake = now + PHASE_CHECK_SECONDS;
+    for (int i = 0; i < 4; i++) {
+        if (sun_transitions[i] > now) {
+            if (sun_transitions[i] < wake)
+                wake = sun_transitions[i];
+            break;
+        }
+    }
+    if (!sun_noon_fired && sun_noon > now && sun_noon < wake)
+        wake = sun_noon;
+    time_t midnight = Local_Midnight(now, 1);
+    if (midnight > now && midnight < wake)
+        wake = midnight;
+
+    phase_timer = g_timeout_source_new_seconds((guint)(wake > now ? wake - now : 1));
+    g_source_set_callback(phase_timer, Phase_Timer_Callback, NULL, NULL);
+    g_source_attach(phase_timer, NULL);
+}
 
 int SunEvents_Set(cJSON* location) {
     if (!location || !SunEventsSettings) return -1;
@@ -143,110 +197,27 @@ int SunEvents_Set(cJSON* location) {
     return 1;
 }
 
-int SunEvents_Between_Dawn_Dusk() {
-    if (!SunEventsSettings) {
-        LOG_WARN("%s: SunEventsSettings is NULL\n", __func__);
-        return 0;
-    }
-
-    char* json = cJSON_PrintUnformatted(SunEventsSettings);
-    if (json) {
-        LOG_TRACE("%s: %s\n", __func__, json);
-        free(json);
-    } else {
-        LOG_TRACE("%s: Unable to print json\n", __func__);
-    }
-
-    cJSON* dawn_obj = cJSON_GetObjectItem(SunEventsSettings, "dawn");
-    cJSON* dusk_obj = cJSON_GetObjectItem(SunEventsSettings, "dusk");
-    if (!dawn_obj || !dusk_obj) {
-        LOG_WARN("%s: Missing dawn or dusk in SunEventsSettings\n", __func__);
-        return 0;
-    }
-
-    time_t now;
-    time(&now);
-
-    // Get dawn and dusk timestamps
-    time_t dawn = (time_t)dawn_obj->valuedouble;
-    time_t dusk = (time_t)dusk_obj->valuedouble;
-
-    // Calculate seconds since midnight for now
-    struct tm tm_now;
-    localtime_r(&now, &tm_now); // Thread-safe version of localtime()
-    time_t midnight_today = now - (tm_now.tm_hour * 3600 + tm_now.tm_min * 60 + tm_now.tm_sec);
-    int now_seconds = now - midnight_today;
-
-    // Calculate seconds since midnight for dawn
-    struct tm tm_dawn;
-    localtime_r(&dawn, &tm_dawn); // Thread-safe version of localtime()
-    time_t midnight_dawn = dawn - (tm_dawn.tm_hour * 3600 + tm_dawn.tm_min * 60 + tm_dawn.tm_sec);
-    int dawn_seconds = dawn - midnight_dawn;
-
-    // Calculate seconds since midnight for dusk
-    struct tm tm_dusk;
-    localtime_r(&dusk, &tm_dusk); // Thread-safe version of localtime()
-    time_t midnight_dusk = dusk - (tm_dusk.tm_hour * 3600 + tm_dusk.tm_min * 60 + tm_dusk.tm_sec);
-    int dusk_seconds = dusk - midnight_dusk;
-
-    LOG_TRACE("%s: now_seconds=%d, dawn_seconds=%d, dusk_seconds=%d\n",
-              __func__, now_seconds, dawn_seconds, dusk_seconds);
+SunPhase SunEvents_Phase() {
+    return sun_phase;
+}
 
-    return (now_seconds >= dawn_seconds && now_seconds <= dusk_seconds) ? 1 : 0;
+int SunEvents_Between_Dawn_Dusk() {
+    return sun_phase != SUN_NIGHT;
 }
 
 int SunEvents_Between_Sunrise_Sunset() {
-    if (!SunEventsSettings) {
-        LOG_WARN("%s: SunEventsSettings is NULL\n", __func__);
-        return 0;
-    }
-
-    LOG_TRACE("%s: Debug 1\n", __func__);
-    char* json = cJSON_PrintUnformatted(SunEventsSettings);
-    if (json) {
-        LOG_TRACE("%s: %s\n", __func__, json);
-        free(json);
-    } else {
-        LOG_TRACE("%s: Unable to print json\n", __func__);
-    }
-    LOG_TRACE("%s: Debug 2\n", __func__);
-
-    cJSON* sunrise_obj = cJSON_GetObjectItem(SunEventsSettings, "sunrise");
-    cJSON* sunset_obj = cJSON_GetObjectItem(SunEventsSettings, "sunset");
-    if (!sunrise_obj || !sunset_obj) {
-        LOG_WARN("%s: Missing sunrise or sunset in SunEventsSettings\n", __func__);
-        return 0;
-    }
-
-    time_t now;
-    time(&now);
-
-    // Get sunrise and sunset timestamps
-    time_t sunrise = (time_t)sunrise_obj->valuedouble;
-    time_t sunset = (time_t)sunset_obj->valuedouble;
-
-    // Calculate seconds since midnight for now
-    struct tm tm_now;
-    localtime_r(&now, &tm_now); // Thread-safe version of localtime()
-    time_t midnight_today = now - (tm_now.tm_hour * 3600 + tm_now.tm_min * 60 + tm_now.tm_sec);
-    int now_seconds = now - midnight_today;
-
-    // Calculate seconds since midnight for sunrise
-    struct tm tm_sunrise;
-    localtime_r(&sunrise, &tm_sunrise); // Thread-safe version of localtime()
-    time_t midnight_sunrise = sunrise - (tm_sunrise.tm_hour * 3600 + tm_sunrise.tm_min * 60 + tm_sunrise.tm_sec);
-    int sunrise_seconds = sunrise - midnight_sunrise;
-
-    // Calculate seconds since midnight for sunset
-    struct tm tm_sunset;
-    localtime_r(&sunset, &tm_sunset); // Thread-safe version of localtime()
-    time_t midnight_sunset = sunset - (tm_sunset.tm_hour * 3600 + tm_sunset.tm_min * 60 + tm_sunset.tm_sec);
-    int sunset_seconds = sunset - midnight_sunset;
+    return sun_phase == SUN_DAY;
+}
 
-    LOG_TRACE("%s: now_seconds=%d, sunrise_seconds=%d, sunset_seconds=%d\n",
-              __func__, now_seconds, sunrise_seconds, sunset_seconds);
+typedef struct {
+    cJSON* location;
+    cJSON* result;	// Copy of the settings after the update
+} SunEventsUpdate;
 
-    return (now_seconds >= sunrise_seconds && now_seconds <= sunset_seconds) ? 1 : 0;
+static void SunEvents_Update(void* data) {
+    SunEventsUpdate* update = (SunEventsUpdate*)data;
+    SunEvents_Set(update->location);
+    update->result = SunEventsSettings ? cJSON_Duplicate(SunEventsSettings, 1) : NULL;
 }
 
 static void HTTP_Endpoint_Sunevents(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
@@ -271,27 +242,21 @@ static void HTTP_Endpoint_Sunevents(const ACAP_HTTP_Response response, const ACA
             return;
         }
         
-        SunEvents_Set(location);
+        // Settings and timers belong to the main loop
+        SunEventsUpdate update = { location, NULL };
+        ACAP_Main_Call(SunEvents_Update, &update);
         cJSON_Delete(location);
-        ACAP_HTTP_Respond_JSON(response, SunEventsSettings);
+        if (!update.result) {
+            ACAP_HTTP_Respond_Error(response, 500, "Sun Events not initialized");
+            return;
+        }
+        ACAP_HTTP_Respond_JSON(response, update.result);
+        cJSON_Delete(update.result);
         return;
     }
     
 	if (strcmp(method, "GET") == 0) {
-		if (!SunEventsSettings) {
-			LOG_WARN("%s: SunEventsSettings is NULL\n", __func__);
-			ACAP_HTTP_Respond_Error(response, 500, "Sun Events not initialized");
-			return;
-		}
-		
-		// Debug print current settings
-		char *debug_str = cJSON_PrintUnformatted(SunEventsSettings);
-		if (debug_str) {
-			LOG_TRACE("%s: Sending JSON response: %s\n", __func__, debug_str);
-			free(debug_str);
-		}
-		
-		ACAP_HTTP_Respond_JSON(response, SunEventsSettings);
+		ACAP_HTTP_Respond_JSON_Cached(response, request, &sunevents_cache);
 		return;
 	}
     
@@ -322,9 +287,10 @@ int SunEvents_Init() {
     cJSON_AddNumberToObject(SunEventsSettings, "sunset", 0);
     cJSON_AddNumberToObject(SunEventsSettings, "dusk", 0);
 
+    for (int i = 0; i < 4; i++)
+        ACAP_EVENTS_Add_Event(sun_phase_events[i].id, sun_phase_events[i].name, 1);
     
     Calculate_Sun_Events(lat, lon);
-    Setup_Midnight_Timer();
     ACAP_HTTP_Node("sunevents", HTTP_Endpoint_Sunevents);
     
     return 0;
@@ -363,22 +329,14 @@ static void Calculate_Sun_Events(double lat, double lon) {
 	// Hour angle for sunrise/sunset
 	double lat_rad = to_rad(lat);
 	double decl_rad = to_rad(declination);
-	double ha_sunrise = acos(cos(to_rad(90.833)) / (cos(lat_rad) * cos(decl_rad)) -
-							 tan(lat_rad) * tan(decl_rad));
-
-	// Convert hour angle to hours
-	double ha_hours_sunrise = to_deg(ha_sunrise) / 15.0;
+	double ha_hours_sunrise = hour_angle_hours(90.833, lat_rad, decl_rad);
 
 	// Calculate sunrise and sunset in UTC
 	double sunrise_utc = solar_noon_utc - ha_hours_sunrise;
 	double sunset_utc = solar_noon_utc + ha_hours_sunrise;
 
 	// Hour angle for civil twilight (dawn/dusk)
-	double ha_twilight = acos(cos(to_rad(96)) / (cos(lat_rad) * cos(decl_rad)) -
-							  tan(lat_rad) * tan(decl_rad));
-
-	// Convert hour angle to hours
-	double ha_hours_twilight = to_deg(ha_twilight) / 15.0;
+	double ha_hours_twilight = hour_angle_hours(96, lat_rad, decl_rad);
 
 	// Calculate dawn and dusk in UTC
 	double dawn_utc = solar_noon_utc - ha_hours_twilight;
@@ -388,27 +346,29 @@ static void Calculate_Sun_Events(double lat, double lon) {
 	int timezone_offset_seconds = local->tm_gmtoff; // Offset in seconds from UTC
 	time_t midnight = now - (local->tm_hour * 3600 + local->tm_min * 60 + local->tm_sec);
 
-	time_t dawn = midnight + (time_t)(dawn_utc * 3600) + timezone_offset_seconds;
-	time_t sunrise = midnight + (time_t)(sunrise_utc * 3600) + timezone_offset_seconds;
-	time_t solar_noon = midnight + (time_t)(solar_noon_utc * 3600) + timezone_offset_seconds;
-	time_t sunset = midnight + (time_t)(sunset_utc * 3600) + timezone_offset_seconds;
-	time_t dusk = midnight + (time_t)(dusk_utc * 3600) + timezone_offset_seconds;
+	// Polar night puts a pair of transitions together at noon, which skips
+	// that phase
+	time_t dawn = clamp_day(midnight + (time_t)(dawn_utc * 3600) + timezone_offset_seconds, midnight);
+	time_t sunrise = clamp_day(midnight + (time_t)(sunrise_utc * 3600) + timezone_offset_seconds, midnight);
+	time_t solar_noon = clamp_day(midnight + (time_t)(solar_noon_utc * 3600) + timezone_offset_seconds, midnight);
+	time_t sunset = clamp_day(midnight + (time_t)(sunset_utc * 3600) + timezone_offset_seconds, midnight);
+	time_t dusk = clamp_day(midnight + (time_t)(dusk_utc * 3600) + timezone_offset_seconds, midnight);
+
+	// Polar day: the sun stays above the angle from midnight to midnight
+	if (ha_hours_sunrise >= 12) {
+		sunrise = midnight;
+		sunset = midnight + 24 * 3600;
+	}
+	if (ha_hours_twilight >= 12) {
+		dawn = midnight;
+		dusk = midnight + 24 * 3600;
+	}
 
 	LOG_TRACE("%s: Calculated times - Dawn: %lld, Sunrise: %lld, Noon: %lld, Sunset: %lld, Dusk: %lld\n",
 			  __func__, (long long)dawn, (long long)sunrise,
 			  (long long)solar_noon, (long long)sunset,
 			  (long long)dusk);
 
-	// Validate calculated times
-	if (dawn < midnight || dawn > midnight + 24 * 3600 ||
-	   sunrise < midnight || sunrise > midnight + 24 * 3600 ||
-	   solar_noon < midnight || solar_noon > midnight + 24 * 3600 ||
-	   sunset < midnight || sunset > midnight + 24 * 3600 ||
-	   dusk < midnight || dusk > midnight + 24 * 3600) {
-	   LOG_WARN("%s: One or more calculated times are out of range\n", __func__);
-	   return;
-	}
-
 	// Update JSON object with calculated values
 	cJSON_ReplaceItemInObject(SunEventsSettings, "lat", cJSON_CreateNumber(lat));
 	cJSON_ReplaceItemInObject(SunEventsSettings, "lon", cJSON_CreateNumber(lon));
@@ -417,6 +377,7 @@ static void Calculate_Sun_Events(double lat, double lon) {
 	cJSON_ReplaceItemInObject(SunEventsSettings, "sunnoon", cJSON_CreateNumber((double)solar_noon));
 	cJSON_ReplaceItemInObject(SunEventsSettings, "sunset", cJSON_CreateNumber((double)sunset));
 	cJSON_ReplaceItemInObject(SunEventsSettings, "dusk", cJSON_CreateNumber((double)dusk));
+	ACAP_JSON_Cache_Touch(&sunevents_cache);
    
 	char* json = cJSON_PrintUnformatted(SunEventsSettings);
 	if(json) {
@@ -424,6 +385,15 @@ static void Calculate_Sun_Events(double lat, double lon) {
 		free(json);
 	}
 	
-    // Setup timer for solar noon
-    Setup_SunNoon_Timer(solar_noon);
+	// Solar noon is announced once a day, by the phase checks
+	time_t day = Local_Midnight(now, 0);
+	if (day != sun_day || solar_noon > now)
+		sun_noon_fired = now >= solar_noon;
+	sun_noon = solar_noon;
+	sun_day = day;
+	sun_transitions[0] = dawn;
+	sun_transitions[1] = sunrise;
+	sun_transitions[2] = sunset;
+	sun_transitions[3] = dusk;
+	Setup_Phase_Timer();
 }
@@ -7,8 +7,16 @@
 extern "C" {
 #endif
 
+typedef enum {
+	SUN_NIGHT = 0,		// Dusk to dawn
+	SUN_DAWN,			// Dawn to sunrise
+	SUN_DAY,			// Sunrise to sunset
+	SUN_DUSK			// Sunset to dusk
+} SunPhase;
+
 int		SunEvents_Init();
 int		SunEvents_Set(cJSON* location);
+SunPhase	SunEvents_Phase();
 int		SunEvents_Between_Dawn_Dusk();
 int		SunEvents_Between_Sunrise_Sunset();
 
@@ -8,6 +8,8 @@
 #include "ACAP.h"
 #include "cJSON.h"
 #include "timelapse.h"
+#include "capture.h"
+#include "scheduler.h"
 
 #define LOG(fmt, args...)    { syslog(LOG_INFO, fmt, ## args); printf(fmt, ## args); }
 #define LOG_WARN(fmt, args...)    { syslog(LOG_WARNING, fmt, ## args); printf(fmt, ## args); }
@@ -17,66 +19,109 @@
 #define TIMELAPSE_PATH "/var/spool/storage/NetworkShare/timelapse2/timelapse.json"
 
 static cJSON *TimelapseProfiles = NULL;
+static ACAP_JSON_Cache TimelapseProfilesCache = { .root = &TimelapseProfiles };
 static Timelapse_Callback Timelapse_ServiceCallBack = 0;
 
-typedef struct {
-    GSource* timer_source;
-    cJSON* profile;
-    int interval;
-} TimelapseTimer;
-
-static GHashTable* timelapse_timers = NULL;
-
-static gboolean
-Timer_Callback(gpointer user_data) {
-    TimelapseTimer* timer = (TimelapseTimer*)user_data;
-    if (timer && timer->profile && Timelapse_ServiceCallBack) {
-        Timelapse_ServiceCallBack(timer->profile);
+// Active profiles.  The id table owns them; TimelapseProfiles keeps their
+// JSON in the order they were added
+static GHashTable* profiles_by_id = NULL;
+static GHashTable* profiles_by_name = NULL;
+static GHashTable* profiles_by_subscription = NULL;
+
+/*
+ * The profile list, its timers and event subscriptions belong to the main
+ * loop.  Changes from HTTP are run there, and other threads read the copy
+ * published as the "profiles" state after each change.
+ */
+static void Timelapse_Profiles_Changed() {
+	ACAP_JSON_Cache_Touch(&TimelapseProfilesCache);
+	if (TimelapseProfiles)
+		ACAP_STATE_Publish("profiles", cJSON_Duplicate(TimelapseProfiles, 1));
+}
+
+static void
+Timer_Callback(void* user_data) {
+    TimelapseProfile* profile = (TimelapseProfile*)user_data;
+    if (profile && Timelapse_ServiceCallBack) {
+        Timelapse_ServiceCallBack(profile);
     }
-    return G_SOURCE_CONTINUE;
 }
 
-// Add this helper function
-static void Cleanup_Timer(const char* id) {
-    if (!timelapse_timers) return;
+static void Cleanup_Timer(TimelapseProfile* profile) {
+    if (!profile->timer) return;
 
-    TimelapseTimer* timer = g_hash_table_lookup(timelapse_timers, id);
-    if (timer) {
-        LOG_TRACE("%s: Removing timer for profile %s\n", __func__, id);
-        if (timer->timer_source) {
-            g_source_destroy(timer->timer_source);
-            g_source_unref(timer->timer_source);
-        }
-        g_hash_table_remove(timelapse_timers, id);
-    }
+    LOG_TRACE("%s: Removing timer for profile %s\n", __func__, profile->id);
+    Scheduler_Remove(profile->timer);
+    profile->timer = NULL;
 }
 
 static void
-Setup_Timer(cJSON* profile) {
-    const char* id = cJSON_GetObjectItem(profile, "id")->valuestring;
-    cJSON* timer_obj = cJSON_GetObjectItem(profile, "timer");
-    
-    if (!timer_obj || timer_obj->type != cJSON_Number) {
+Setup_Timer(TimelapseProfile* profile) {
+    Cleanup_Timer(profile);
+    if (profile->interval <= 0) {
         return;
     }
 
-    TimelapseTimer* timer = g_hash_table_lookup(timelapse_timers, id);
-    if (timer) {
-        // Remove existing timer
-        if (timer->timer_source) {
-            g_source_destroy(timer->timer_source);
-            g_source_unref(timer->timer_source);
-        }
-    } else {
-        timer = g_new0(TimelapseTimer, 1);
-        g_hash_table_insert(timelapse_timers, g_strdup(id), timer);
-    }
+    profile->timer = Scheduler_Add(profile->interval, Timer_Callback, profile);
+    if (!profile->timer)
+        LOG_WARN("%s: No timer for profile %s\n", __func__, profile->id);
+}
+
+// Value destructor of profiles_by_id.  The JSON is left to TimelapseProfiles
+static void
+Profile_Free(gpointer data) {
+	TimelapseProfile* profile = (TimelapseProfile*)data;
+	Cleanup_Timer(profile);
+	if( profile->subscriptionId )
+		ACAP_EVENTS_Unsubscribe(profile->subscriptionId);
+	Capture_Plan_Unref(profile->plan);
+	g_free(profile->name);
+	g_free(profile);
+}
 
-    timer->profile = profile;
-    timer->interval = timer_obj->valueint;
-    timer->timer_source = g_timeout_source_new_seconds(timer->interval);
-    g_source_set_callback(timer->timer_source, Timer_Callback, timer, NULL);
-    g_source_attach(timer->timer_source, NULL);
+// Read the fields the trigger path needs.  Returns an error message or NULL
+static const char*
+Profile_Parse(TimelapseProfile* profile, cJSON* json) {
+	const char* id = cJSON_GetStringValue(cJSON_GetObjectItem(json,"id"));
+	if( !id || !strlen(id) )
+		return "Invalid id in profile";
+	if( strlen(id) >= TIMELAPSE_ID_SIZE )
+		return "Profile id is too long";
+	const char* name = cJSON_GetStringValue(cJSON_GetObjectItem(json,"name"));
+	if( !name || !strlen(name) )
+		return "Profile is missing name";
+	const char* resolution = cJSON_GetStringValue(cJSON_GetObjectItem(json,"resolution"));
+	if( !resolution || !strlen(resolution) )
+		return "Profile is missing resolution";
+	const char* conditions = cJSON_GetStringValue(cJSON_GetObjectItem(json,"conditions"));
+	if( !conditions || !strlen(conditions) )
+		return "Profile is missing conditions";
+
+	snprintf(profile->id, sizeof(profile->id), "%s", id);
+	profile->name = g_strdup(name);
+	profile->json = json;
+
+	profile->condition = TIMELAPSE_ALWAYS;
+	if( strcmp(conditions, "dawn_dusk") == 0 )
+		profile->condition = TIMELAPSE_DAWN_DUSK;
+	if( strcmp(conditions, "sunrise-sunset") == 0 )
+		profile->condition = TIMELAPSE_SUNRISE_SUNSET;
+
+	// "WIDTHxHEIGHT"
+	const char* height = strchr(resolution, 'x');
+	profile->width = atoi(resolution);
+	profile->height = height ? atoi(height + 1) : 1080;
+
+	cJSON* fps = cJSON_GetObjectItem(json,"fps");
+	profile->fps = fps && cJSON_IsNumber(fps) && fps->valueint > 0 ? fps->valueint : 10;
+	profile->overlay = cJSON_IsTrue(cJSON_GetObjectItem(json,"overlay"));
+	cJSON* timer = cJSON_GetObjectItem(json,"timer");
+	profile->interval = timer && cJSON_IsNumber(timer) ? timer->valueint : 0;
+
+	profile->plan = Capture_Plan_New(profile->id, profile->width, profile->height, profile->fps, profile->overlay);
+	if( !profile->plan )
+		return "Unable to set up capture";
+	return NULL;
 }
 
 void
@@ -90,14 +135,10 @@ Timelapse_Event_Callback(cJSON *event, void* jsonProfile) {
 		props = props->next;
 	}
 
-	char *json = cJSON_PrintUnformatted(event);
-	if( json ) {
-		LOG_TRACE("%s: %s",__func__,json);
-		free(json);
-	}
-
-	if(Timelapse_ServiceCallBack)
-		Timelapse_ServiceCallBack((cJSON*)jsonProfile);
+	cJSON* subscription = cJSON_GetObjectItem(event, "subscription");
+	TimelapseProfile* profile = subscription ? Timelapse_Find_Profile_By_Subscription(subscription->valueint) : 0;
+	if(profile && Timelapse_ServiceCallBack)
+		Timelapse_ServiceCallBack(profile);
 }
 
 
@@ -160,152 +201,111 @@ int DeleteDirectory(const char* path) {
     return 0;
 }
 
-cJSON*
+TimelapseProfile*
 Timelapse_Find_Profile_By_Id( const char *id ) {
-	if(!TimelapseProfiles)
-		return 0;
-	cJSON* profile = TimelapseProfiles->child;
-	while(profile) {
-		if( cJSON_GetObjectItem(profile,"id") && strcmp( cJSON_GetObjectItem(profile,"id")->valuestring, id ) == 0 )
-			return profile;
-		profile = profile->next;
-	}
-	LOG_TRACE("%s: No profile found with id %s\n",__func__,id);
-	return 0;
+	TimelapseProfile* profile = profiles_by_id && id ? g_hash_table_lookup(profiles_by_id, id) : 0;
+	if( !profile )
+		LOG_TRACE("%s: No profile found with id %s\n",__func__,id);
+	return profile;
 }
 
-cJSON*
+TimelapseProfile*
 Timelapse_Find_Profile_By_Name( const char *name ) {
-	if(!TimelapseProfiles)
+	TimelapseProfile* profile = profiles_by_name && name ? g_hash_table_lookup(profiles_by_name, name) : 0;
+	if( !profile )
+		LOG_TRACE("%s: No profile found with name %s\n",__func__,name);
+	return profile;
+}
+
+TimelapseProfile*
+Timelapse_Find_Profile_By_Subscription( int subscriptionId ) {
+	if( !profiles_by_subscription || !subscriptionId )
 		return 0;
-	cJSON* profile = TimelapseProfiles->child;
-	while(profile) {
-		if( cJSON_GetObjectItem(profile,"name") && strcmp( cJSON_GetObjectItem(profile,"name")->valuestring, name ) == 0 )
-			return profile;
-		profile = profile->next;
-	}
-	LOG_TRACE("%s: No profile found with name %s\n",__func__,name);
-	return 0;
+	return g_hash_table_lookup(profiles_by_subscription, GINT_TO_POINTER(subscriptionId));
 }
 
-cJSON*
+TimelapseProfile*
 Timelapse_Find_Profile_By_Event_Name( const char *name ) {
-	if(!TimelapseProfiles)
+	if(!TimelapseProfiles || !name)
 		return 0;
-	cJSON* profile = TimelapseProfiles->child;
-	while(profile) {
-		cJSON* triggerEvent = cJSON_GetObjectItem(profile,"triggerEvent");
-		if( triggerEvent && strcmp(cJSON_GetObjectItem(triggerEvent,name)->valuestring, name ) == 0 )
-			return profile;
-		profile = profile->next;
+	cJSON* json;
+	cJSON_ArrayForEach(json, TimelapseProfiles) {
+		const char* eventName = cJSON_GetStringValue(cJSON_GetObjectItem(cJSON_GetObjectItem(json,"triggerEvent"),"name"));
+		if( eventName && strcmp(eventName, name) == 0 )
+			return Timelapse_Find_Profile_By_Id(cJSON_GetStringValue(cJSON_GetObjectItem(json,"id")));
 	}
 	LOG_TRACE("%s: No profile found with event name %s\n",__func__,name);
 	return 0;
 }
 
 int Timelapse_Remove_Profile_By_Id(const char* id) {
-    if (!TimelapseProfiles)
+    TimelapseProfile* profile = Timelapse_Find_Profile_By_Id(id);
+    if (!profile) {
+        LOG_TRACE("%s: Profile %s not found\n", __func__, id);
         return 1;
-
-    int index = 0;
-    int removeIndex = -1;
-    cJSON* remove = 0;
-    cJSON* profile = TimelapseProfiles->child;
-    
-    while (profile) {
-        if (cJSON_GetObjectItem(profile,"id") && 
-            strcmp(cJSON_GetObjectItem(profile,"id")->valuestring, id) == 0) {
-            remove = profile;
-            removeIndex = index;
-        }
-        index++;
-        profile = profile->next;
     }
-    
-    if (remove && removeIndex >= 0) {
-        // Handle event subscription cleanup
-        cJSON* triggerEvent = cJSON_GetObjectItem(remove, "triggerEvent");
-        if (triggerEvent && triggerEvent->type == cJSON_Object) {
-            int subscriptionId = cJSON_GetObjectItem(remove, "subscriptionId") ? 
-                               cJSON_GetObjectItem(remove, "subscriptionId")->valueint : 0;
-            if (subscriptionId) 
-                ACAP_EVENTS_Unsubscribe(subscriptionId);
-        }
-
-        // Handle timer cleanup
-        cJSON* timer = cJSON_GetObjectItem(remove, "timer");
-        if (timer && timer->type == cJSON_Number) {
-            Cleanup_Timer(id);
-            LOG_TRACE("%s: Removing timer for profile %s\n", __func__, id);
-        }
 
-        cJSON_DeleteItemFromArray(TimelapseProfiles, removeIndex);
-        LOG_TRACE("%s: Profile %s removed\n", __func__, id);
-    } else {
-        LOG_TRACE("%s: Profile %s not found\n", __func__, id);
-    }
+    // Another profile may have taken the name since
+    if (g_hash_table_lookup(profiles_by_name, profile->name) == profile)
+        g_hash_table_remove(profiles_by_name, profile->name);
+    if (profile->subscriptionId)
+        g_hash_table_remove(profiles_by_subscription, GINT_TO_POINTER(profile->subscriptionId));
+
+    // The id may point into the JSON, so it goes last
+    cJSON* json = cJSON_DetachItemViaPointer(TimelapseProfiles, profile->json);
+    g_hash_table_remove(profiles_by_id, profile->id);
+    cJSON_Delete(json);
+    Timelapse_Profiles_Changed();
+    LOG_TRACE("%s: Profile removed\n", __func__);
     return 1;
 }
 
 /* Add profile and subscribe to an event */
 int
-Timelapse_Activate_Profile( cJSON* profile ) {
-	int subscriptionId	= 0;
-	
-	if( !profile ) {
+Timelapse_Activate_Profile( cJSON* json ) {
+	if( !json ) {
 		LOG_WARN("%s: profile is NULL\n",__func__);
 		return 0;
 	}
-	char *json = cJSON_PrintUnformatted(profile);
-	if( json ) {
-		LOG_TRACE("%s: %s\n",__func__,json);
-		free(json);
+	char *text = cJSON_PrintUnformatted(json);
+	if( text ) {
+		LOG_TRACE("%s: %s\n",__func__,text);
+		free(text);
 	}
 	if(!TimelapseProfiles)
 		TimelapseProfiles = cJSON_CreateArray();
 
-	const char* profileId = cJSON_GetObjectItem(profile,"Id")?cJSON_GetObjectItem(profile,"Id")->valuestring:0;
-	if( !profileId ) {
-		LOG_WARN("%s: Invalid in in profile\n",__func__);
-		return 0;
-	}
-
-	if(!cJSON_GetObjectItem(profile,"name") || !strlen(cJSON_GetObjectItem(profile,"name")->valuestring) ) {
-		LOG_WARN("%s: Profile is missing name\n", __func__);
-		return 0;
-	}
-
-	if(!cJSON_GetObjectItem(profile,"resolution") || !strlen(cJSON_GetObjectItem(profile,"resolution")->valuestring) ) {
-		LOG_WARN("%s: Profile is missing resolution\n", __func__);
-		return 0;
-	}
-
-	if(!cJSON_GetObjectItem(profile,"conditions") || !strlen(cJSON_GetObjectItem(profile,"conditions")->valuestring) ) {
-		LOG_WARN("%s: Profile is missing conditions\n", __func__);
+	TimelapseProfile* profile = g_new0(TimelapseProfile, 1);
+	const char* error = Profile_Parse(profile, json);
+	if( error ) {
+		LOG_WARN("%s: %s\n", __func__, error);
+		Profile_Free(profile);
 		return 0;
 	}
 
-	Timelapse_Remove_Profile_By_Id(profileId);
-
-	if( cJSON_GetObjectItem( profile,"subscriptionId") )
-		cJSON_DeleteItemFromObject(profile,"subscriptionId" );
+	Timelapse_Remove_Profile_By_Id(profile->id);
 
-	cJSON* triggerEvent = cJSON_GetObjectItem(profile,"triggerEvent");
-	cJSON* timer = cJSON_GetObjectItem(profile,"timer");
+	if( cJSON_GetObjectItem( json,"subscriptionId") )
+		cJSON_DeleteItemFromObject(json,"subscriptionId" );
 
-	if( timer && timer->type == cJSON_Number ) {
-		Setup_Timer(profile);
-	}
-
-	if( triggerEvent->type == cJSON_Object ) {
-		subscriptionId = ACAP_EVENTS_Subscribe( triggerEvent, (void*)profile );
-		if( !subscriptionId ) {
+	cJSON* triggerEvent = cJSON_GetObjectItem(json,"triggerEvent");
+	if( triggerEvent && triggerEvent->type == cJSON_Object ) {
+		profile->subscriptionId = ACAP_EVENTS_Subscribe( triggerEvent, (void*)json );
+		if( !profile->subscriptionId ) {
 			LOG_WARN("%s: Unable to subscribe to event\n",__func__);
+			Profile_Free(profile);
 			return 0;
 		}
-		cJSON_AddNumberToObject(profile, "subscriptionId", subscriptionId);
+		cJSON_AddNumberToObject(json, "subscriptionId", profile->subscriptionId);
+		g_hash_table_insert(profiles_by_subscription, GINT_TO_POINTER(profile->subscriptionId), profile);
 	}
-	cJSON_AddItemToArray(TimelapseProfiles,profile);
+
+	Setup_Timer(profile);
+
+	g_hash_table_insert(profiles_by_id, profile->id, profile);
+	g_hash_table_replace(profiles_by_name, profile->name, profile);
+	cJSON_AddItemToArray(TimelapseProfiles,json);
+	Timelapse_Profiles_Changed();
 	return 1;
 }
 
@@ -316,7 +316,8 @@ static int Timelapse_Load_Profiles() {
     FILE *file = fopen(TIMELAPSE_PATH, "r");
     if (!file) {
         LOG_WARN("%s: File not found\n", __func__);
-        TimelapseProfiles = cJSON_CreateArray();
+        if (!TimelapseProfiles)
+            TimelapseProfiles = cJSON_CreateArray();
         return Timelapse_Save_Profiles();
     }
 
@@ -397,7 +398,69 @@ cJSON* Timelapse_Get_Profiles() {
     return TimelapseProfiles;
 }
 
-static void HTTP_Endpoint_Timelpase(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+// Check a posted profile and fill in defaults.  Returns an error message or NULL
+static const char* Timelapse_Prepare_Profile(cJSON* profile) {
+	if( !profile || profile->type != cJSON_Object )
+		return "Invalid profile";
+	const char* id = cJSON_GetObjectItem(profile,"id")?cJSON_GetObjectItem(profile,"id")->valuestring:0;
+	if( !id || !strlen(id) )
+		return "Invalid profile. Missing id";
+	const char* name = cJSON_GetObjectItem(profile,"name")?cJSON_GetObjectItem(profile,"name")->valuestring:0;
+	if( !name || !strlen(name) )
+		return "Invalid profile. Missing name";
+	const char* resolution = cJSON_GetObjectItem(profile,"resolution")?cJSON_GetObjectItem(profile,"resolution")->valuestring:0;
+	if( !resolution || !strlen(resolution) )
+		return "Invalid profile. Missing resolution";
+
+	if( !cJSON_GetObjectItem(profile,"fps" ) )
+		cJSON_AddNumberToObject( profile,"fps", 10 );
+	if( !cJSON_GetObjectItem(profile,"archived" ) )
+		cJSON_AddNumberToObject( profile,"archived", 10 );
+	return NULL;
+}
+
+// Activate an array of profiles and save timelapse.json once
+static void Timelapse_Import(const ACAP_HTTP_Response response, cJSON* list) {
+	int imported = 0;
+	cJSON* failed = cJSON_CreateArray();
+	cJSON* item = list->child;
+	while( item ) {
+		cJSON* next = item->next;
+		cJSON* profile = cJSON_DetachItemViaPointer(list, item);
+		// Taken before validation so rejected profiles can be told apart
+		char id[128] = "";
+		cJSON* idItem = cJSON_GetObjectItem(profile,"id");
+		if( idItem && cJSON_IsString(idItem) )
+			snprintf(id, sizeof(id), "%s", idItem->valuestring);
+		const char* error = Timelapse_Prepare_Profile(profile);
+		if( !error && !Timelapse_Activate_Profile(profile) )
+			error = "Activation failed";
+		if( !error ) {
+			Ensure_Directory_Exists(id);
+			imported++;
+		} else {
+			LOG_WARN("%s: Profile %s not imported: %s\n", __func__, id, error);
+			cJSON* entry = cJSON_CreateObject();
+			cJSON_AddStringToObject(entry, "id", id);
+			cJSON_AddStringToObject(entry, "error", error);
+			cJSON_AddItemToArray(failed, entry);
+			cJSON_Delete(profile);
+		}
+		item = next;
+	}
+	cJSON_Delete(list);
+
+	if( imported )
+		Timelapse_Save_Profiles();
+
+	cJSON* result = cJSON_CreateObject();
+	cJSON_AddNumberToObject(result, "imported", imported);
+	cJSON_AddItemToObject(result, "failed", failed);
+	ACAP_HTTP_Respond_JSON(response, result);
+	cJSON_Delete(result);
+}
+
+static void Timelapse_HTTP_Update(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
 
     const char* method = ACAP_HTTP_Get_Method(request);
     if (!method) {
@@ -426,26 +489,17 @@ static void HTTP_Endpoint_Timelpase(const ACAP_HTTP_Response response, const ACA
             ACAP_HTTP_Respond_Error(response, 400, "Invalid JSON data");
             return;
         }
-		const char* id = cJSON_GetObjectItem(profile,"id")?cJSON_GetObjectItem(profile,"id")->valuestring:0;
-		if( !id || !strlen(id) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing id");
-			return;
-		}
-		const char* name = cJSON_GetObjectItem(profile,"name")?cJSON_GetObjectItem(profile,"name")->valuestring:0;
-		if( !name || !strlen(name) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing name");
+		if( profile->type == cJSON_Array ) {
+			Timelapse_Import(response, profile);
 			return;
 		}
-		const char* resolution = cJSON_GetObjectItem(profile,"resolution")?cJSON_GetObjectItem(profile,"resolution")->valuestring:0;
-		if( !resolution || !strlen(resolution) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing resolution");
+		const char* error = Timelapse_Prepare_Profile(profile);
+		if( error ) {
+			cJSON_Delete(profile);
+            ACAP_HTTP_Respond_Error(response, 500, error);
 			return;
 		}
-			
-		if( !cJSON_GetObjectItem(profile,"fps" ) )
-			cJSON_AddNumberToObject( profile,"fps", 10 );
-		if( !cJSON_GetObjectItem(profile,"archived" ) )
-			cJSON_AddNumberToObject( profile,"archived", 10 );
+		const char* id = cJSON_GetObjectItem(profile,"id")->valuestring;
 		
         // Add the new profile to the list
         if (!Timelapse_Activate_Profile(profile)) {
@@ -478,26 +532,17 @@ static void HTTP_Endpoint_Timelpase(const ACAP_HTTP_Response response, const ACA
             return;
         }
 
-		const char* id = cJSON_GetObjectItem(profile,"id")?cJSON_GetObjectItem(profile,"id")->valuestring:0;
-		if( !id || !strlen(id) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing id");
-			return;
-		}
-		const char* name = cJSON_GetObjectItem(profile,"name")?cJSON_GetObjectItem(profile,"name")->valuestring:0;
-		if( !name || !strlen(name) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing name");
+		if( profile->type == cJSON_Array ) {
+			Timelapse_Import(response, profile);
 			return;
 		}
-		const char* resolution = cJSON_GetObjectItem(profile,"resolution")?cJSON_GetObjectItem(profile,"resolution")->valuestring:0;
-		if( !resolution || !strlen(resolution) ) {
-            ACAP_HTTP_Respond_Error(response, 500, "Invalid profile. Missing resolution");
+		const char* error = Timelapse_Prepare_Profile(profile);
+		if( error ) {
+			cJSON_Delete(profile);
+            ACAP_HTTP_Respond_Error(response, 500, error);
 			return;
 		}
-
-		if( !cJSON_GetObjectItem(profile,"fps" ) )
-			cJSON_AddNumberToObject( profile,"fps", 10 );
-		if( !cJSON_GetObjectItem(profile,"archived" ) )
-			cJSON_AddNumberToObject( profile,"archived", 10 );
+		const char* id = cJSON_GetObjectItem(profile,"id")->valuestring;
 
         // Update the profile
         if (!Timelapse_Activate_Profile(profile)) {
@@ -538,50 +583,75 @@ static void HTTP_Endpoint_Timelpase(const ACAP_HTTP_Response response, const ACA
 		return;
 	}
 
-    // Handle GET: Retrieve all timelapse profiles
-    if (strcmp(method, "GET") == 0) {
-        cJSON* profiles = Timelapse_Get_Profiles();
-        if (!profiles) {
-            LOG_WARN("%s: Failed to get profiles\n", __func__);
-            ACAP_HTTP_Respond_Error(response, 500, "Failed to retrieve timelapse profiles");
-            return;
-        }
+    // If method is not supported
+    ACAP_HTTP_Respond_Error(response, 405, "Method Not Allowed");
+}
 
-        char *json_str = cJSON_PrintUnformatted(profiles);
-        if (!json_str) {
-            LOG_WARN("%s: Failed to serialize profiles\n", __func__);
-            ACAP_HTTP_Respond_Error(response, 500, "Failed to serialize profiles");
-            return;
-        }
+typedef struct {
+	ACAP_HTTP_Response response;
+	ACAP_HTTP_Request request;
+} TimelapseHTTPCall;
 
-        LOG_TRACE("%s: Response JSON: %s\n", __func__, json_str);
-        ACAP_HTTP_Respond_JSON(response, profiles);
-        free(json_str);
-        return;
-    }
+static void Timelapse_HTTP_Main(void* data) {
+	TimelapseHTTPCall* call = (TimelapseHTTPCall*)data;
+	Timelapse_HTTP_Update(call->response, call->request);
+}
 
-    // If method is not supported
-    ACAP_HTTP_Respond_Error(response, 405, "Method Not Allowed");
+static void HTTP_Endpoint_Timelpase(const ACAP_HTTP_Response response, const ACAP_HTTP_Request request) {
+	const char* method = ACAP_HTTP_Get_Method(request);
+
+	// Reads are served from the cached text; changes run on the main loop
+	if (method && strcmp(method, "GET") == 0) {
+		ACAP_HTTP_Respond_JSON_Cached(response, request, &TimelapseProfilesCache);
+		return;
+	}
+
+	TimelapseHTTPCall call = { response, request };
+	ACAP_Main_Call(Timelapse_HTTP_Main, &call);
+}
+
+typedef struct {
+	char id[128];
+	double timestamp;
+} TimelapseArchived;
+
+static gboolean Timelapse_Archived_Update(gpointer user_data) {
+	TimelapseArchived* archived = (TimelapseArchived*)user_data;
+	TimelapseProfile* profile = Timelapse_Find_Profile_By_Id(archived->id);
+	if (profile) {
+		if (!cJSON_GetObjectItem(profile->json, "archived"))
+			cJSON_AddNumberToObject(profile->json, "archived", archived->timestamp);
+		else
+			cJSON_SetNumberValue(cJSON_GetObjectItem(profile->json, "archived"), archived->timestamp);
+		Timelapse_Profiles_Changed();
+	}
+	free(archived);
+	return G_SOURCE_REMOVE;
+}
+
+void Timelapse_Set_Archived(const char* id, double timestamp) {
+	if (!id)
+		return;
+	TimelapseArchived* archived = calloc(1, sizeof(TimelapseArchived));
+	if (!archived)
+		return;
+	snprintf(archived->id, sizeof(archived->id), "%s", id);
+	archived->timestamp = timestamp;
+	// Queued rather than waited for; the caller may hold locks the main loop takes
+	g_idle_add(Timelapse_Archived_Update, archived);
 }
 
 void Timelapse_Reset() {
-	Timelapse_Load_Profiles();
-	
-    if (!timelapse_timers) return;
+	// Stop every profile, then take what is left in timelapse.json
+	g_hash_table_remove_all(profiles_by_name);
+	g_hash_table_remove_all(profiles_by_subscription);
+	g_hash_table_remove_all(profiles_by_id);
+	if( TimelapseProfiles )
+		cJSON_Delete(TimelapseProfiles);
+	TimelapseProfiles = cJSON_CreateArray();
+	Timelapse_Profiles_Changed();
 
-    GHashTableIter iter;
-    gpointer key, value;
-    
-    g_hash_table_iter_init(&iter, timelapse_timers);
-    while (g_hash_table_iter_next(&iter, &key, &value)) {
-        TimelapseTimer* timer = (TimelapseTimer*)value;
-        if (timer && timer->timer_source) {
-            g_source_destroy(timer->timer_source);
-            g_source_unref(timer->timer_source);
-        }
-    }
-    g_hash_table_destroy(timelapse_timers);
-    timelapse_timers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	Timelapse_Load_Profiles();
 }
 
 int
@@ -589,8 +659,9 @@ Timelapse_Init(Timelapse_Callback callback) {
     Timelapse_ServiceCallBack = callback;
     ACAP_EVENTS_Unsubscribe(0);
     
-    // Initialize timer hash table
-    timelapse_timers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    profiles_by_id = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, Profile_Free);
+    profiles_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    profiles_by_subscription = g_hash_table_new(g_direct_hash, g_direct_equal);
     
     ACAP_HTTP_Node("timelapse", HTTP_Endpoint_Timelpase);
     ACAP_EVENTS_SetCallback(Timelapse_Event_Callback);
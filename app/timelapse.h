@@ -1,22 +1,55 @@
 #ifndef _timelapse_
 #define _timelapse_
 
+#include <glib.h>
 #include "cJSON.h"
 
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
-typedef void (*Timelapse_Callback)(cJSON* profile);
+#define TIMELAPSE_ID_SIZE	64
+
+typedef enum {
+	TIMELAPSE_ALWAYS = 0,
+	TIMELAPSE_DAWN_DUSK,
+	TIMELAPSE_SUNRISE_SUNSET
+} Timelapse_Condition;
+
+/*
+ * A profile as the trigger path sees it.  The fields are parsed and the
+ * capture plan compiled once when the profile is activated; json is the
+ * profile as posted, kept for timelapse.json and /timelapse.  Profiles
+ * belong to the main loop.
+ */
+typedef struct {
+	char				id[TIMELAPSE_ID_SIZE];
+	char*				name;
+	Timelapse_Condition	condition;
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		fps;
+	int					overlay;
+	int					interval;		// Timer seconds, 0 when event triggered only
+	int					subscriptionId;
+	struct SchedulerTimer*	timer;		// See scheduler.h
+	struct CapturePlan*	plan;			// What a trigger queues, see capture.h
+	cJSON*				json;
+} TimelapseProfile;
+
+typedef void (*Timelapse_Callback)(const TimelapseProfile* profile);
 
 int		Timelapse_Init( Timelapse_Callback callback );
 int 	Timelapse_Save_Profiles();
 cJSON* 	Timelapse_Get_Profiles();
-cJSON*  Timelapse_Find_Profile_By_Id( const char *id );
-cJSON*  Timelapse_Find_Profile_By_Name( const char *name );
-cJSON*  Timelapse_Find_Profile_By_Event_Name( const char *name );
+TimelapseProfile*	Timelapse_Find_Profile_By_Id( const char *id );
+TimelapseProfile*	Timelapse_Find_Profile_By_Name( const char *name );
+TimelapseProfile*	Timelapse_Find_Profile_By_Event_Name( const char *name );
+TimelapseProfile*	Timelapse_Find_Profile_By_Subscription( int subscriptionId );
 int		Timelapse_Remove_Profile_By_Id( const char* id );
 void	Timelapse_Reset();
+// Record when a profile's recording was archived; safe from any thread
+void	Timelapse_Set_Archived( const char* id, double timestamp );
 
 #ifdef  __cplusplus
 }